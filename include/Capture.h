@@ -0,0 +1,141 @@
+/**
+ * Wire capture component for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mqpp {
+namespace detail {
+
+/**
+ * Capture file format
+ *
+ * An 8 byte magic followed by one record per mqtt frame:
+ *  - uint64 timestamp in ns (steady clock)
+ *  - uint32 frame length
+ *  - uint8  direction
+ *  - the frame bytes
+ * All integers are stored in host byte order. A capture that wasn't
+ * closed cleanly may end in a truncated record.
+ *
+ * Streamed inbound publishes are recorded as their headers followed by
+ * one record per payload piece, outbound publishes sent from a file
+ * only with their headers.
+ */
+enum class CaptureDirection : uint8_t {
+    inbound = 0,
+    outbound = 1
+};
+
+/**
+ * Buffered capture file writer
+ *
+ * Records are copied into a small pool of prefaulted memory buffers, so
+ * recording a frame costs a memcpy and no syscall or page fault. Full
+ * buffers are written to the file by a writer thread and come back to
+ * the pool. Only if the disk can't keep up does the I/O thread wait for
+ * a free buffer.
+ */
+class CaptureWriter {
+
+    static const size_t CHUNK = 1 << 20;
+    static const int BUFFERS = 4;
+
+    struct Buffer {
+        std::unique_ptr<uint8_t[]> data;
+        size_t used;
+    };
+
+    int fd;
+    Buffer buffers[BUFFERS];
+    Buffer *current;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<Buffer *> full;      // waiting to be written, in order
+    std::vector<Buffer *> spare;
+    bool failed;                    // a write failed, recording stopped
+    bool stop;
+
+public:
+
+    CaptureWriter();
+    ~CaptureWriter();
+
+    CaptureWriter(const CaptureWriter &) = delete;
+    CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+    /** @return false if the file can't be created */
+    bool open(const std::string &path);
+
+    /** write out what is buffered and close the file */
+    void close();
+
+    void record(CaptureDirection dir, uint64_t timestamp_ns, const uint8_t *data, size_t length);
+
+private:
+
+    void run_writer();
+    bool next_buffer();
+    void write(const void *data, size_t length);
+};
+
+/**
+ * Capture file reader, maps the whole file
+ */
+class CaptureReader {
+
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    size_t pos;
+
+public:
+
+    struct Record {
+        uint64_t timestamp_ns;
+        CaptureDirection dir;
+        const uint8_t *data;
+        uint32_t length;
+    };
+
+    CaptureReader();
+    ~CaptureReader();
+
+    CaptureReader(const CaptureReader &) = delete;
+    CaptureReader &operator=(const CaptureReader &) = delete;
+
+    /** @return false if the file can't be read or is no capture file */
+    bool open(const std::string &path);
+
+    /** @return false at the end of the capture (or on a truncated record) */
+    bool next(Record &rec);
+};
+
+}   // namespace detail
+}   // namespace mqpp
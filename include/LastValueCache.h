@@ -0,0 +1,95 @@
+/**
+ * Last value cache component for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mqpp {
+namespace detail {
+
+/**
+ * Latest payload per topic, written by the loop thread and readable
+ * from any number of threads without locking
+ *
+ * The topic index is an insert-only open addressing table of atomic
+ * entry pointers, so lookups never wait for the writer. Each entry is
+ * a seqlock around its payload buffer; readers retry if they raced
+ * with an update. Buffers are only replaced when a payload outgrows
+ * them, and old ones are kept until the cache is destroyed, so a
+ * reader can never touch freed memory.
+ */
+class LastValueCache {
+
+    struct Buffer {
+        size_t capacity;
+        std::unique_ptr<char[]> data;
+    };
+
+    struct Entry {
+        std::string topic;
+        std::atomic<uint64_t> seq;
+        std::atomic<Buffer *> buf;
+        std::atomic<size_t> len;
+        std::vector<std::unique_ptr<Buffer>> buffers;  // owned, writer only
+    };
+
+    size_t mask;
+    size_t count;
+    std::unique_ptr<std::atomic<Entry *>[]> slots;
+    std::vector<std::unique_ptr<Entry>> entries;
+    std::vector<std::string> filters;
+
+public:
+
+    /** @param max_topics number of distinct topics the cache can hold */
+    explicit LastValueCache(size_t max_topics);
+
+    /** writer side: cache topics matching this filter from now on */
+    void add_filter(const std::string &filter);
+
+    /** writer side: true if the topic matches any of the filters */
+    bool matches(const std::string &topic) const;
+
+    /**
+     * writer side: store a new value for a topic
+     * @return false if the cache is full and the topic is new */
+    bool update(const std::string &topic, const uint8_t *payload, size_t length);
+
+    /**
+     * reader side: copy the latest value for a topic
+     * @return version of the value (incremented on every update), 0 if
+     *          nothing was received on this topic yet */
+    uint64_t read(const std::string &topic, std::string &payload) const;
+
+    /** reader side: version of the latest value without copying it */
+    uint64_t version(const std::string &topic) const;
+
+private:
+
+    Entry *find(const std::string &topic) const;
+    Entry *insert(const std::string &topic);
+};
+
+}   // namespace detail
+}   // namespace mqpp
@@ -22,30 +22,128 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "mqpp.h"
 #include "MqttSocket.h"
+#include "TimerWheel.h"
+#include "LastValueCache.h"
+#include "Validation.h"
 
 namespace mqpp {
 
 class mqtt_client::Mqpp {
     enum class CONNSTATE {
         NOT_CONNECTED,
+        TCP_PENDING,
         CONNECTION_PENDING,
         CONNECTED,
         PING_PENDING,
         SHUTTING_DOWN
     } connstate;
 
+    /**
+     * a queued outbound message. Conflated messages are indexed by
+     * topic as long as sending them hasn't started.
+     */
+    struct OutboundMessage {
+        protocol::Message msg;
+        std::string topic;
+        bool conflated;
+        std::shared_ptr<detail::FileBody> body;     // payload sent from a file, if any
+    };
+
+    static const int MAX_READS_PER_LOOP = 16;
+
     detail::MqttSocket sock;
     std::deque<protocol::Message> inqueue;
+    static const int LANES = 4;
+    std::list<OutboundMessage> outqueue[LANES];
+    std::atomic<size_t> lane_depth[LANES];  // for monitoring from other threads
+    int tx_lane;        // lane whose front message is half sent, -1 if none
+    size_t tx_offset;   // bytes of that message already sent
+    bool tx_stalled;    // that message waits for its pipe to fill
+    bool replaying;
+
+    bool conflate_all;
+    std::vector<std::string> conflation_filters;
+    struct ConflatedEntry {
+        int lane;
+        std::list<OutboundMessage>::iterator message;
+    };
+    std::unordered_map<std::string, ConflatedEntry> conflated;
+
+    /**
+     * a subscribe() / unsubscribe() batch, or an internal resubscribe
+     * after reconnect. It completes when all of its packets are acked.
+     */
+    struct SubscribeRequest {
+        bool unsubscribe;
+        bool resubscribe;
+        std::vector<std::string> filters;
+        std::vector<QoS> qos;
+        std::vector<SubscribeResult> results;
+        std::unordered_set<std::string> cancelled;  // unsubscribed while pending
+        size_t pending_packets;
+        size_t next_filter;     // first filter not sent yet, held back without packet ids
+    };
+
+    /** the part of a request that went out in one packet */
+    struct RequestPacket {
+        std::shared_ptr<SubscribeRequest> request;
+        size_t first;
+        size_t count;
+    };
+
+    std::list<std::shared_ptr<SubscribeRequest>> requests;
+    std::unordered_map<uint16_t, RequestPacket> pending_acks;
+    std::unordered_map<std::string, QoS> subscriptions;
+    std::unordered_set<uint16_t> qos2_received;
+    uint16_t last_packet_id;
+    size_t max_packet_size;
+
+    detail::TimerWheel timers;
+    detail::TimerWheel::TimerId keepalive_timer, connect_timer, reconnect_timer;
 
     std::function<void(ConnectionState, DisconnectReason)> connect_status_callback;  
+    std::function<void(const std::vector<std::string> &, const std::vector<SubscribeResult> &)> subscribe_callback;
+    std::function<void(const std::vector<std::string> &)> unsubscribe_callback;
     std::function<void(LogLevel, std::string)> logging_callback;
     
-    std::chrono::time_point<std::chrono::steady_clock> ctrl_event, now;
+    std::string host;
+    int port;
+    std::string bind_ip;
+    SocketOpts sock_opts;
+    std::chrono::seconds keepalive;
+    std::chrono::seconds connect_timeout;
+    std::chrono::time_point<std::chrono::steady_clock> last_sent;
+
+    std::chrono::seconds reconnect_first_delay, reconnect_max_delay, reconnect_delay;
+    bool reconnect_exponential;
+
+    std::chrono::seconds qos_retry;
+    int max_inflight_messages;
+
+    std::unique_ptr<detail::LastValueCache> last_values;
+    size_t last_value_max_topics;
+
+    // inbound publish whose payload is being streamed
+    struct InboundStream {
+        std::string topic;
+        QoS qos;
+        uint16_t packet_id;
+        size_t offset;
+        size_t total;
+        bool active;
+        bool skip;      // qos 2 redelivery or unusable, consume silently
+    } instream;
+    std::function<void(const std::string &, const uint8_t *, size_t, size_t, size_t)> stream_callback;
 
 
 public:
@@ -54,8 +152,48 @@ public:
     int connect(    const std::string &host, 
                     const int port, 
                     const std::chrono::duration<int> keepalive,
-                    const std::string &bind_ip); 
-    int publish(std::string topic, std::string payload, QoS qos, Retain retain);
+                    const std::string &bind_ip,
+                    const SocketOpts &sock_opts); 
+    int publish(std::string topic, std::string payload, QoS qos, Retain retain, Lane lane);
+    int publish_file(std::string topic, int fd, uint64_t offset, size_t length, QoS qos, Retain retain, Lane lane);
+
+    void set_stream_callback(const std::function<void(const std::string &, const uint8_t *, size_t, size_t, size_t)> &cb, size_t min_length);
+
+    inline size_t outqueue_depth(Lane lane) const {
+        return lane_depth[static_cast<int>(lane)].load(std::memory_order_relaxed);
+    }
+
+    int subscribe(const std::vector<std::pair<std::string, QoS>> &filters);
+    int unsubscribe(const std::vector<std::string> &filters);
+
+    inline void set_subscribe_opts(size_t max_packet_size) {
+        this->max_packet_size = max_packet_size;
+    }
+
+    inline void set_subscribe_callback(const std::function<void(const std::vector<std::string> &, const std::vector<SubscribeResult> &)> &cb) {
+        subscribe_callback = cb;
+    }
+
+    inline void set_unsubscribe_callback(const std::function<void(const std::vector<std::string> &)> &cb) {
+        unsubscribe_callback = cb;
+    }
+
+    void set_reconnect_opts(int first_delay_s, int max_delay_s, bool exponential_delay);
+    void set_qos_opts(int retry_s, int max_inflight_messages);
+
+    void set_conflation_opts(bool conflate_all);
+    void add_conflation_filter(const std::string &filter);
+
+    void set_last_value_cache_opts(size_t max_topics);
+    void add_last_value_filter(const std::string &filter);
+
+    inline uint64_t last_value(const std::string &topic, std::string &payload) const {
+        return last_values ? last_values->read(topic, payload) : 0;
+    }
+
+    inline uint64_t last_value_version(const std::string &topic) const {
+        return last_values ? last_values->version(topic) : 0;
+    }
 
     inline void set_connect_status_callback(const std::function<void(ConnectionState, DisconnectReason)> &cb) {
         connect_status_callback = cb;
@@ -65,9 +203,42 @@ public:
         logging_callback = cb;
     }
 
-    int loop();
+    int loop(std::chrono::milliseconds max_wait);
+
+    void start_capture(const std::string &path);
+    void stop_capture();
+    int replay(const std::string &path, bool realtime);
+
+    inline std::chrono::steady_clock::time_point next_deadline() const {
+        return timers.next_deadline();
+    }
 
 private:
+    int start_connect();
+    int send_connect();
+    void connect_failed();
+    int send(const protocol::Message &msg);
+    void enqueue(Lane lane, OutboundMessage &&msg);
+    int flush_outqueue();
+    bool flushable() const;
+    bool conflates(const std::string &topic) const;
+    void arm_keepalive();
+    void on_keepalive();
+    void drop_connection(DisconnectReason reason);
+    void schedule_reconnect();
+    void process_inqueue();
+    void handle_publish(const protocol::Message &msg);
+    void start_stream(const protocol::Message &msg, bool skip);
+    void on_stream_data(const uint8_t *data, size_t length);
+    void finish_stream();
+    void handle_subscribe_ack(const protocol::Message &msg);
+
+    uint16_t next_packet_id();
+    void send_request(const std::shared_ptr<SubscribeRequest> &req);
+    bool send_packets(const std::shared_ptr<SubscribeRequest> &req);
+    void complete_request(const std::shared_ptr<SubscribeRequest> &req);
+    void restore_subscriptions();
+
     void log(LogLevel lvl, std::string text);
 };
 
@@ -20,72 +20,217 @@
 #pragma once
 
 #include "mqtt_311.h"
+#include "Capture.h"
 
 #include <deque>
+#include <functional>
+#include <memory>
 #include <string>
 #include <cstring>
+#include <vector>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 namespace mqpp {
 namespace detail {
 
 enum class SocketState {
     tcp_connected,
+    tcp_pending,
     resolv_error,
     socket_error,
     connect_error
 };
 
+/**
+ * publish payload that is sent straight from a file descriptor
+ *
+ * Regular files go out with sendfile from offset, pipes with splice
+ * (offset is ignored). Owns fd and closes it when the message is gone.
+ */
+struct FileBody {
+    int fd;
+    uint64_t offset;
+    size_t length;
+    bool pipe;
+
+    FileBody(int fd, uint64_t offset, size_t length, bool pipe)
+        : fd(fd), offset(offset), length(length), pipe(pipe) {}
+    ~FileBody() {
+        ::close(fd);
+    }
+
+    FileBody(const FileBody &) = delete;
+    FileBody &operator=(const FileBody &) = delete;
+};
+
 class MqttSocket {
 
+    static const int RX_CHUNK = 16384;
+    static const int STREAM_CHUNK = 65536;
+
     int sock;
+    std::vector<uint8_t> rxbuf;
+
+    // resolved broker addresses, kept so that reconnects don't block on dns
+    struct Address {
+        int family, socktype, protocol;
+        sockaddr_storage addr;
+        socklen_t addrlen;
+    };
+    std::string resolved_host;
+    int resolved_port;
+    std::vector<Address> addresses;
+    size_t next_address;
+
+    // inbound publishes from stream_threshold bytes on are streamed:
+    // their headers are queued like a message, the payload goes to
+    // stream_sink once begin_stream() was called
+    size_t stream_threshold;
+    std::function<void(const uint8_t *, size_t)> stream_sink;
+    size_t stream_remaining;
+    bool stream_started;
+
+    std::unique_ptr<CaptureWriter> capture;
+    SocketOpts opts;
+    int option_errors;
 
 public:
 
     MqttSocket();
 
     /** 
-     * try to establish a socket connection 
+     * start establishing a socket connection 
      * 
-     * This will try to establish a socket (only). 
-     * @return 0 if success, -1 on any error*/
+     * This will try to establish a socket (only). The host is resolved on
+     * the first attempt, later attempts reuse the addresses. The connect
+     * itself is nonblocking, see connect_result(). Socket options are
+     * applied before connecting, so buffer sizes take part in window
+     * scaling negotiation.
+     * @return tcp_connected or tcp_pending on success, the error otherwise */
     SocketState connect_socket( const std::string &host,
                         const int port,
-                        const std::string &bind_ip);
+                        const std::string &bind_ip,
+                        const SocketOpts &opts);
+
+    /**
+     * check a pending connect
+     * @return 1 if connected, 0 if still pending, -1 if it failed */
+    int connect_result();
+
+    /** the current address didn't work out, try the next one next time */
+    void connect_failed() {
+        ++next_address;
+    }
+
+    /** resolve the host again on the next connect */
+    void forget_addresses() {
+        addresses.clear();
+    }
+
+    /** number of socket options that could not be applied on the last connect */
+    int failed_options() const {
+        return option_errors;
+    }
+
+    /**
+     * block until the socket becomes readable (or writable, if asked
+     * for), wait_fd becomes readable or the timeout elapses
+     *
+     * Also just sleeps for the timeout if there is no socket.
+     * @return number of ready fds, 0 on timeout, -1 on error */
+    int wait_ready(int timeout_ms, bool writable, int wait_fd = -1);
+
+    /** close the socket, if open */
+    void close_socket();
 
-    /** send one message out on the socket */
-    int send(const protocol::Message &msg);
+    /**
+     * send (the rest of) one message out on the socket
+     *
+     * @param offset number of bytes of the message already sent
+     * @param more a body follows, hold back a partial segment for it
+     * @return number of bytes sent, 0 if the socket buffer is full,
+     *          -1 on a socket error */
+    int send(const protocol::Message &msg, size_t offset = 0, bool more = false);
+
+    /**
+     * send (the rest of) a file body without copying it to user space
+     *
+     * Bodies are not recorded in captures, only the message headers are.
+     * @param offset number of bytes of the body already sent
+     * @return number of bytes sent, 0 if the socket buffer is full, -1 on
+     *          a socket error, -2 if the file or pipe ended before the body
+     *          was complete, -3 if a pipe has no data right now */
+    int send_file(const FileBody &body, size_t offset);
+
+    /**
+     * stream inbound publishes with a remaining length of at least
+     * threshold bytes to sink, 0 turns streaming off
+     */
+    void set_stream(size_t threshold, std::function<void(const uint8_t *, size_t)> sink);
+
+    /** payload bytes of the current streamed publish not delivered yet */
+    size_t stream_length() const {
+        return stream_remaining;
+    }
+
+    /**
+     * start delivering the payload of the streamed publish whose headers
+     * were queued last. Reception pauses until this is called.
+     * @return number of complete messages pushed on the inbound queue
+     *          after the streamed one ended, -2 if a frame is malformed */
+    int begin_stream(std::deque<protocol::Message> &inqueue);
 
     /**
      * receive pending message from socket (if any)
      *
      * This method should be called cyclically from the main loop
-     * It will receive data from the socket until either there is no
-     * more data pending or one mqtt message is completely received.
-     * In the latter case, the message will be pushed on the inbound
-     * message queue. This method can also push events on the event 
+     * It will receive the data pending on the socket (up to RX_CHUNK
+     * bytes) and push every completely received mqtt message on the
+     * inbound message queue. This method can also push events on the event 
      * loop, for example in case of a connection error etc.
      *
-     * @return will return 1 is more data might be waiting on the socket after a mqtt
-     *              message is completed, the loop mechanism can then decide wether
+     * @return will return 1 if messages were enqueued or more data might be
+     *              waiting on the socket, the loop mechanism can then decide wether
      *              to call receive() again or not. 0 if no more data seems to be
-     *              waiting on the socket. */
+     *              waiting on the socket, -1 if the connection was closed or failed,
+     *              -2 if the broker sent a malformed frame. */
     int receive(std::deque<protocol::Message> &inqueue);
 
+    /**
+     * feed bytes into the receive path as if they came from the socket
+     *
+     * Used to replay captures.
+     * @return number of complete messages pushed on the inbound queue,
+     *          -2 if a frame is malformed */
+    int inject(const uint8_t *data, size_t length, std::deque<protocol::Message> &inqueue);
+
+    /**
+     * record all inbound and outbound frames to a capture file
+     * @return false if the file can't be created */
+    bool start_capture(const std::string &path);
+
+    void stop_capture();
+
 private:
 
+    int deframe(std::deque<protocol::Message> &inqueue);
+    int deliver(std::deque<protocol::Message> &inqueue);
+    void record(CaptureDirection dir, const uint8_t *data, size_t length);
+
+    void apply_options();
+    void rearm_quickack();
+
+    /** @return bytes received, 0 if there was no data, -1 if the socket was closed or failed */
     int handle_recv_return(int in) {
         if (in == 0) {   // socket was closed
-            // FIXME: push disconnect event here
-//            std::cout << "Socket was closed." << std::endl;
-            exit(0);
+            return -1;
         } if (in == -1) {
             if(errno == EAGAIN || errno == EWOULDBLOCK) {
                 return 0; // no error, just no data.
             } else {
-                // FIXME: push disconnect event here
- //               std::cout << "Socket error:" << strerror(errno) << std::endl;
-                exit(0);
+                return -1;
             }
         }
         return in;
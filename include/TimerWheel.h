@@ -0,0 +1,137 @@
+/**
+ * Timer handling component for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace mqpp {
+namespace detail {
+
+/**
+ * Hierarchical timing wheel
+ *
+ * Holds all timers of the client: keepalive pings, connect timeouts,
+ * qos retries and reconnect backoff. Timers live in a node pool and
+ * are addressed by TimerId handles, so arm() and cancel() are O(1) and
+ * do not allocate once the pool has grown to its working size.
+ *
+ * Resolution is one millisecond. Four levels of 64 slots cover about
+ * 4.6 hours, timers further out are parked on the top level and are
+ * cascaded down again until they come into range.
+ */
+class TimerWheel {
+
+    static const unsigned SLOT_BITS = 6;
+    static const unsigned SLOTS = 1 << SLOT_BITS;
+    static const unsigned LEVELS = 4;
+    static const uint32_t NIL = 0xffffffff;
+    static const uint16_t FREE = 0xffff;
+
+public:
+
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void()> Callback;
+
+    /**
+     * handle for an armed timer
+     *
+     * The generation counter makes stale handles harmless: cancelling
+     * a timer that has already fired (and whose node was reused) is a no-op.
+     */
+    struct TimerId {
+        uint32_t index = NIL;
+        uint32_t generation = 0;
+    };
+
+    explicit TimerWheel(clock::time_point origin = clock::now());
+
+    /** arm a timer that fires once at (or shortly after) the given time point */
+    TimerId arm(clock::time_point when, Callback cb);
+
+    /** arm a timer that fires once after the given timeout */
+    TimerId arm(clock::duration timeout, Callback cb) {
+        return arm(clock::now() + timeout, std::move(cb));
+    }
+
+    /**
+     * cancel a timer
+     *
+     * The id is reset, so it can be passed to cancel() again safely.
+     * @return true if the timer was still armed */
+    bool cancel(TimerId &id);
+
+    bool armed(const TimerId &id) const;
+
+    /** number of armed timers */
+    size_t size() const {
+        return count;
+    }
+
+    /**
+     * advance the wheel to the given time point
+     *
+     * Callbacks of all expired timers are called from within this
+     * method. They may arm and cancel timers freely.
+     * @return number of timers that fired */
+    size_t advance(clock::time_point now);
+
+    /**
+     * time point at which advance() needs to be called next
+     *
+     * This is exact for timers due within the next 64ms and a lower
+     * bound otherwise (the point where the timer gets cascaded), so
+     * sleeping until then never oversleeps a timer.
+     * @return clock::time_point::max() if no timer is armed */
+    clock::time_point next_deadline() const;
+
+private:
+
+    struct Node {
+        uint64_t expires;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation;
+        uint16_t slot;
+        Callback cb;
+    };
+
+    std::vector<Node> nodes;
+    uint32_t free_head;
+    uint32_t heads[LEVELS * SLOTS];
+    uint64_t occupied[LEVELS];
+    uint64_t current;       // all ticks up to and including current are processed
+    size_t count;
+    clock::time_point origin;
+
+    uint64_t to_tick(clock::time_point tp, bool round_up) const;
+    uint64_t next_tick() const;
+
+    void insert(uint32_t index, uint64_t earliest);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+    void cascade(unsigned level);
+    size_t expire();
+};
+
+}   // namespace detail
+}   // namespace mqpp
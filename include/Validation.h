@@ -0,0 +1,67 @@
+/**
+ * String and topic validation for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace mqpp {
+namespace protocol {
+
+/**
+ * Implementation used for the ascii fast path. The best one the cpu
+ * supports is picked at startup.
+ */
+enum class SimdLevel {
+    scalar,
+    sse4,
+    avx2
+};
+
+SimdLevel simd_level();
+
+/** force an implementation (for benchmarks), clamped to what the cpu supports */
+void set_simd_level(SimdLevel level);
+
+/**
+ * check a mqtt string (section 1.5.3 of the mqtt 3.1.1 oasis standard):
+ * at most 65535 bytes of well-formed UTF-8 without U+0000
+ */
+bool valid_string(const char *s, size_t length);
+
+inline bool valid_string(const std::string &s) {
+    return valid_string(s.data(), s.size());
+}
+
+/** check a topic name for publishing: a non-empty string without wildcards */
+bool valid_topic_name(const char *s, size_t length);
+
+inline bool valid_topic_name(const std::string &s) {
+    return valid_topic_name(s.data(), s.size());
+}
+
+/**
+ * check a topic filter for subscribing: a non-empty string where + takes
+ * a whole level and # only comes as the whole last level (section 4.7.1)
+ */
+bool valid_topic_filter(const std::string &s);
+
+}   // namespace protocol
+}   // namespace mqpp
@@ -18,6 +18,7 @@
  */
 
 #pragma once
+#include <algorithm>
 #include <vector>
 
 #include "mqpp.h"
@@ -44,6 +45,40 @@ enum class MsgType : uint8_t {
     disconnect = 0xe0
 };
 
+/** largest value the remaining length field can encode */
+const size_t MAX_REMAINING_LENGTH = 268435455;
+
+/**
+ * match a topic name against a subscription filter with + and #
+ * wildcards (section 4.7 of the mqtt 3.1.1 oasis standard)
+ */
+inline bool topic_matches(const std::string &filter, const std::string &topic) {
+    // filters starting with a wildcard don't match $SYS etc. (4.7.2)
+    if(!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) {
+        return false;
+    }
+    size_t f = 0, t = 0;
+    while(f < filter.size()) {
+        char c = filter[f];
+        if(c == '#') {
+            return true;
+        }
+        if(c == '+') {
+            while(t < topic.size() && topic[t] != '/') ++t;
+            ++f;
+            continue;
+        }
+        if(t < topic.size() && topic[t] == c) {
+            ++f;
+            ++t;
+            continue;
+        }
+        // "sport/#" also matches the parent level "sport"
+        return t == topic.size() && c == '/' && f + 2 == filter.size() && filter[f + 1] == '#';
+    }
+    return t == topic.size();
+}
+
 /**
  * Preliminary, I'm not yet sure what the best abstraction is
  */
@@ -60,12 +95,31 @@ public:
         return buf.size();
     }
 
-    void append_string(std::string s) {
+    /**
+     * append a length prefixed string. Strings from the api must have been
+     * checked with valid_string() / valid_topic_name() before, to stay
+     * within the 16 bit length.
+     */
+    void append_string(const std::string &s) {
         buf.push_back(s.size() >> 8);
         buf.push_back(s.size() & 0xff);
         std::copy(s.begin(), s.end(), std::back_inserter(buf));
     }
 
+    void append_byte(uint8_t b) {
+        buf.push_back(b);
+    }
+
+    /** append the remaining length field of the fixed header (section 2.2.3) */
+    void append_remaining_length(size_t length) {
+        do {
+            uint8_t encoded = length & 0x7f;
+            length >>= 7;
+            if(length > 0) encoded |= 0x80;
+            buf.push_back(encoded);
+        } while(length > 0);
+    }
+
     /**
      * construct a mqtt message from a buffer (for reception)
      */
@@ -87,9 +141,9 @@ public:
         if(!username.empty()) remlength += (2 + username.size());
         if(!passwd.empty()) remlength += (2 + passwd.size());
 
-        buf.push_back(static_cast<uint8_t>(MsgType::connect));
-        buf.push_back(remlength & 0x7f);      // FIXME: call calculating method here
         buf.reserve(remlength + 5);           // max possible length for fixed header
+        buf.push_back(static_cast<uint8_t>(MsgType::connect));
+        append_remaining_length(remlength);
         
         append_string("MQTT");
         buf.push_back(4);   // protocol level, 4 for mqtt v3.1.1
@@ -109,16 +163,53 @@ public:
                 const QoS qos,
                 const Retain retain)
     {
-        int remlength = 2 + topic.size() + payload.size();
+        size_t remlength = 2 + topic.size() + payload.size();
+        buf.reserve(remlength + 5);
         buf.push_back(      static_cast<uint8_t>(MsgType::publish) 
                         |   static_cast<uint8_t>(qos)
                         |   static_cast<uint8_t>(retain));
-        buf.push_back(remlength & 0x7f);      // FIXME: call calculating method here
-        buf.reserve(remlength + 5);
+        append_remaining_length(remlength);
         append_string(topic);
         if(!payload.empty()) std::copy(payload.begin(), payload.end(), std::back_inserter(buf));
     }
 
+    /**
+     * construct only the headers of a mqtt publish message whose
+     * payload of payload_length bytes is sent separately
+     */
+    Message(    const std::string &topic,
+                const size_t payload_length,
+                const QoS qos,
+                const Retain retain)
+    {
+        buf.reserve(2 + topic.size() + 5);
+        buf.push_back(      static_cast<uint8_t>(MsgType::publish) 
+                        |   static_cast<uint8_t>(qos)
+                        |   static_cast<uint8_t>(retain));
+        append_remaining_length(2 + topic.size() + payload_length);
+        append_string(topic);
+    }
+
+    /**
+     * construct a message starting with a packet identifier: the acks
+     * (remlength 2) and subscribe / unsubscribe, whose payload the caller
+     * appends. remlength has to include the packet identifier.
+     */
+    Message(    const MsgType type,
+                const uint16_t packet_id,
+                const size_t remlength)
+    {
+        buf.reserve(remlength + 5);
+        // these have reserved flags 0010 in the fixed header (section 2.2.2)
+        bool flags =    type == MsgType::subscribe 
+                    ||  type == MsgType::unsubscribe 
+                    ||  type == MsgType::pubrel;
+        buf.push_back(static_cast<uint8_t>(type) | (flags ? 0x02 : 0x00));
+        append_remaining_length(remlength);
+        buf.push_back(packet_id >> 8);
+        buf.push_back(packet_id & 0xff);
+    }
+
     /**
      * construct a mqtt pingreq message
      */
@@ -128,11 +219,67 @@ public:
         buf.push_back(0);
     }
 
-    MsgType type() {
+    MsgType type() const {
         return static_cast<MsgType>(buf[0] & 0xf0);
     }
 
-    static int get_missing_length(const std::vector<uint8_t> &buf) {
+    /** length of the fixed header (type byte plus remaining length field) */
+    size_t header_length() const {
+        size_t pos = 1;
+        while(pos < buf.size() && (buf[pos] & 128)) ++pos;
+        return pos + 1;
+    }
+
+    QoS qos() const {
+        return static_cast<QoS>(buf[0] & 0x06);
+    }
+
+    /** topic name of a publish message */
+    std::string topic() const {
+        size_t pos = header_length();
+        if(pos + 2 > buf.size()) return std::string();
+        size_t len = std::min<size_t>((buf[pos] << 8) | buf[pos + 1], buf.size() - pos - 2);
+        return std::string(reinterpret_cast<const char *>(&buf[pos + 2]), len);
+    }
+
+    /**
+     * packet identifier of a publish (qos > 0) or of an ack / suback /
+     * unsuback message, 0 if there is none
+     */
+    uint16_t packet_id() const {
+        size_t pos = header_length();
+        if(type() == MsgType::publish) {
+            if(qos() == QoS::at_most_once || pos + 2 > buf.size()) return 0;
+            pos += 2 + ((buf[pos] << 8) | buf[pos + 1]);
+        }
+        if(pos + 2 > buf.size()) return 0;
+        return (buf[pos] << 8) | buf[pos + 1];
+    }
+
+    /** offset of the payload of a publish message */
+    size_t payload_offset() const {
+        size_t pos = header_length();
+        if(pos + 2 > buf.size()) return buf.size();
+        pos += 2 + ((buf[pos] << 8) | buf[pos + 1]);
+        if(qos() != QoS::at_most_once) pos += 2;   // packet identifier
+        return std::min(pos, buf.size());
+    }
+
+    const uint8_t *payload() const {
+        return buf.data() + payload_offset();
+    }
+
+    size_t payload_length() const {
+        return buf.size() - payload_offset();
+    }
+
+    /**
+     * decode the fixed header at the start of a receive buffer
+     *
+     * @param remlength set to the remaining length
+     * @return length of the fixed header if it is complete, 0 if more
+     *          data is needed, -1 if the remaining length field is malformed */
+    static int fixed_header(const uint8_t *data, size_t size, size_t &remlength) {
         // example "pseudo code" directly from the standard document:
         // multiplier = 1
         // value = 0
@@ -144,18 +291,27 @@ public:
         //       throw Error(Malformed Remaining Length)
         // while ((encodedByte AND 128) != 0)
 
-        int pos = 1;
-        int length = 0;
-        int step = 0;
-        
-        do {
-            length += (buf[pos] & 127) * 1 << (step * 7);
-            ++step;
-            if(step > 3) {
-                return -1;
+        remlength = 0;
+        for(size_t pos = 1; pos < 5; ++pos) {
+            if(pos >= size) {
+                return 0;
             }
-        } while (buf[pos] & 128);
-        return length - 3 + step;
+            remlength += static_cast<size_t>(data[pos] & 127) << ((pos - 1) * 7);
+            if(!(data[pos] & 128)) {
+                return pos + 1;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * true if this holds only the headers of a longer frame, as for
+     * streamed publishes whose payload is delivered separately
+     */
+    bool truncated() const {
+        size_t remlength;
+        int header = fixed_header(buf.data(), buf.size(), remlength);
+        return header > 0 && header + remlength > buf.size();
     }
 };
 
@@ -18,9 +18,13 @@
  */
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <chrono>
 #include <memory>
+#include <functional>
+#include <utility>
+#include <vector>
 
 namespace mqpp {
 
@@ -49,6 +53,30 @@ enum class QoS : uint8_t {
     exactly_once = 0x02 << 1
 };
 
+/**
+ * Outbound priority lanes
+ *  served strictly in this order, switching only at frame boundaries.
+ *  The control lane carries PINGREQ, acks, (un)subscribe and DISCONNECT,
+ *  the others carry publishes (passed as last parameter to publish()).
+ */
+enum class Lane : uint8_t {
+    control,
+    high,
+    normal,
+    bulk
+};
+
+/**
+ * Result for one topic filter of a subscribe() batch
+ *  as passed to the subscribe_callback (SUBACK return codes)
+ */
+enum class SubscribeResult : uint8_t {
+    granted_at_most_once = 0x00,
+    granted_at_least_once = 0x01,
+    granted_exactly_once = 0x02,
+    failure = 0x80
+};
+
 /**
  * Current state of the mqtt connection
  * as passed to the connect_status_callback
@@ -69,7 +97,35 @@ enum class ConnectionState {
 enum class DisconnectReason {
     none,
     socket_error,
-    
+    timeout,
+    protocol_error
+};
+
+/**
+ * Socket tuning options
+ *  passed as last parameter to connect(). Zero / false / -1 keeps the
+ *  operating system default. Options the OS refuses (e.g. busy polling
+ *  without CAP_NET_ADMIN) are logged as a warning and otherwise ignored.
+ */
+struct SocketOpts {
+    bool tcp_nodelay = false;   // disable Nagle's algorithm
+    bool tcp_quickack = false;  // ack immediately, re-armed after every recv
+    int sndbuf = 0;             // SO_SNDBUF in bytes
+    int rcvbuf = 0;             // SO_RCVBUF in bytes
+    int busy_poll_us = 0;       // SO_BUSY_POLL in microseconds
+    int cpu = -1;               // SO_INCOMING_CPU, also pins the thread calling connect()
+    bool spin_poll = false;     // loop() never blocks waiting for data
+
+    /** profile for latency sensitive deployments, trades a core for tail latency */
+    static SocketOpts low_latency(int cpu = -1) {
+        SocketOpts opts;
+        opts.tcp_nodelay = true;
+        opts.tcp_quickack = true;
+        opts.busy_poll_us = 50;
+        opts.cpu = cpu;
+        opts.spin_poll = true;
+        return opts;
+    }
 };
 
 enum class LogLevel {
@@ -93,25 +149,122 @@ public:
     void connect(   const std::string &host = "localhost", 
                     const int port = 1883, 
                     const std::chrono::duration<int> keepalive = std::chrono::seconds(20), 
-                    const std::string &bind_ip = "");
+                    const std::string &bind_ip = "",
+                    const SocketOpts &sock_opts = SocketOpts());
     
     void set_reconnect_opts(int first_delay_s = 1, int max_delay_s = 64, bool exponential_delay = true);
     void set_qos_opts(int retry_s = 10, int max_inflight_messages = 0);
 
+    /**
+     * receive large publishes piecewise as they arrive
+     *
+     * Publishes with a remaining length of at least min_length bytes are
+     * not buffered in full but handed to cb in pieces: topic, data, length,
+     * offset of the piece in the payload and total payload length. QoS 1
+     * and 2 publishes are acked after the last piece. Streamed publishes
+     * bypass the last value cache. An empty cb turns streaming off.
+     */
+    void set_stream_callback(const std::function<void(const std::string &, const uint8_t *, size_t, size_t, size_t)> &cb, size_t min_length=65536);
+
     void set_logging_callback(const std::function<void(LogLevel, std::string)> &cb, LogLevel lvl = LogLevel::warn);
 
     void set_connect_status_callback(const std::function<void(ConnectionState, DisconnectReason)> &cb);
     void set_message_callback();
     void set_publish_callback();
-    void set_subscribe_callback();
-    void set_unsubscribe_callback();
+    void set_subscribe_callback(const std::function<void(const std::vector<std::string> &, const std::vector<SubscribeResult> &)> &cb);
+    void set_unsubscribe_callback(const std::function<void(const std::vector<std::string> &)> &cb);
+
+    /**
+     * Maximum size of the SUBSCRIBE / UNSUBSCRIBE packets a batch is
+     * packed into, adjust it to what the broker accepts.
+     */
+    void set_subscribe_opts(size_t max_packet_size = 65536);
+
+    /**
+     * Conflation of QoS 0 publishes
+     *  a publish to a topic that still has an unsent message in the
+     *  outbound queue replaces that message in place, so the queue holds
+     *  at most one message per conflated topic. If the new publish names
+     *  another lane, the message moves to the back of that lane. Applies
+     *  to all topics or to those matching one of the filters.
+     */
+    void set_conflation_opts(bool conflate_all = false);
+    void add_conflation_filter(const std::string &filter);
+
+    /**
+     * Last value cache
+     *  the latest payload of inbound publishes on topics matching one of
+     *  the filters is kept in the client. last_value() and
+     *  last_value_version() may be called from any thread and never block,
+     *  the versions increase with every update (0 = nothing received yet).
+     *  Set up the cache and filters before starting reader threads.
+     */
+    void set_last_value_cache_opts(size_t max_topics = 4096);
+    void add_last_value_filter(const std::string &filter);
+    uint64_t last_value(const std::string &topic, std::string &payload) const;
+    uint64_t last_value_version(const std::string &topic) const;
 
-    void publish(std::string topic, std::string payload, QoS qos=QoS::at_most_once, Retain retain=Retain::yes);
-    void subscribe();
-    void unsubscribe();
+    /**
+     * Wire capture and replay
+     *  start_capture() records every inbound and outbound frame with a
+     *  monotonic timestamp to a file. replay() feeds the inbound frames
+     *  of such a capture through the parser and dispatch path without a
+     *  broker, at recorded speed or as fast as possible, and returns the
+     *  number of frames replayed (-1 if the file can't be read or the
+     *  client isn't disconnected).
+     */
+    void start_capture(const std::string &path);
+    void stop_capture();
+    int replay(const std::string &path, bool realtime = false);
+
+    void publish(std::string topic, std::string payload, QoS qos=QoS::at_most_once, Retain retain=Retain::yes, Lane lane=Lane::normal);
+
+    /**
+     * publish length bytes of a file (from offset) or a pipe without
+     * loading them into memory
+     *
+     * The message headers are written first, then the kernel moves the
+     * body straight to the socket (sendfile for files, splice for pipes).
+     * fd is duplicated, the caller may close it right away. These
+     * publishes are never conflated. Only QoS 0 for now.
+     *
+     * Once its body has started, a publish holds the connection until it
+     * is complete: while the writer of a pipe stalls, no other packet
+     * goes out, acks and PINGREQ included. loop() waits for the pipe
+     * instead of spinning. A stall of about twice the keepalive interval
+     * times the connection out, and the publish is dropped with it.
+     */
+    void publish_file(std::string topic, int fd, uint64_t offset, size_t length, QoS qos=QoS::at_most_once, Retain retain=Retain::yes, Lane lane=Lane::bulk);
+
+    /** number of messages queued in an outbound lane, may be called from any thread */
+    size_t outqueue_depth(Lane lane) const;
+
+    /**
+     * Subscribe to / unsubscribe from a batch of topic filters
+     *  a batch is packed into as few packets as the maximum packet size
+     *  allows, and all packets are sent without waiting for each other.
+     *  Once all of them are acknowledged, the subscribe / unsubscribe
+     *  callback is called once for the whole batch, with the results in
+     *  the same order as the filters. Active subscriptions are restored
+     *  in bulk after every reconnect. An empty batch is ignored. A batch
+     *  containing an invalid filter is rejected as a whole: a subscribe
+     *  callback reports failure for every filter. While all packet
+     *  identifiers are in use, the remaining filters wait for acks.
+     */
+    void subscribe(const std::vector<std::pair<std::string, QoS>> &filters);
+    void unsubscribe(const std::vector<std::string> &filters);
 
     // FIXME: temporary for initial development, remove later:
-    int loop();
+    /**
+     * run one iteration of the client
+     *
+     * Waits up to max_wait for inbound data or the next timer, unless
+     * spin polling is enabled in the socket options.
+     */
+    int loop(std::chrono::milliseconds max_wait = std::chrono::milliseconds(0));
+
+    /** time point at which loop() has timer work to do next */
+    std::chrono::steady_clock::time_point next_deadline();
 
 private:
 
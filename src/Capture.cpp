@@ -0,0 +1,214 @@
+/**
+ * Wire capture component for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "Capture.h"
+
+namespace mqpp {
+namespace detail {
+
+static const char MAGIC[8] = { 'M', 'Q', 'P', 'P', 'C', 'A', 'P', '1' };
+static const size_t RECORD_HEADER = 8 + 4 + 1;
+
+CaptureWriter::CaptureWriter()
+    : fd(-1), current(nullptr), failed(false), stop(false)
+{
+}
+
+CaptureWriter::~CaptureWriter() {
+    close();
+}
+
+bool CaptureWriter::open(const std::string &path) {
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+    spare.clear();
+    for(Buffer &b : buffers) {
+        if(!b.data) {
+            // touch every page now, not on the I/O thread later
+            b.data.reset(new uint8_t[CHUNK]);
+            std::memset(b.data.get(), 0, CHUNK);
+        }
+        b.used = 0;
+        spare.push_back(&b);
+    }
+    failed = false;
+    stop = false;
+    current = spare.back();
+    spare.pop_back();
+    writer = std::thread(&CaptureWriter::run_writer, this);
+    write(MAGIC, sizeof(MAGIC));
+    return true;
+}
+
+void CaptureWriter::close() {
+    if(writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(current && current->used) {
+                full.push_back(current);
+            }
+            current = nullptr;
+            stop = true;
+        }
+        cond.notify_all();
+        writer.join();
+    }
+    current = nullptr;
+    full.clear();
+    if(fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void CaptureWriter::record(CaptureDirection dir, uint64_t timestamp_ns, const uint8_t *data, size_t length) {
+    if(!current) {
+        return;
+    }
+    uint32_t len = length;
+    uint8_t d = static_cast<uint8_t>(dir);
+    write(&timestamp_ns, sizeof(timestamp_ns));
+    write(&len, sizeof(len));
+    write(&d, sizeof(d));
+    write(data, length);
+}
+
+void CaptureWriter::run_writer() {
+    std::unique_lock<std::mutex> guard(lock);
+    for(;;) {
+        cond.wait(guard, [this]() { return stop || !full.empty(); });
+        if(full.empty()) {
+            return;     // stopped and everything is written
+        }
+        Buffer *b = full.front();
+        full.pop_front();
+        guard.unlock();
+        bool ok = true;
+        for(size_t pos = 0; pos < b->used; ) {
+            ssize_t n = ::write(fd, b->data.get() + pos, b->used - pos);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) {
+                ok = false;
+                break;
+            }
+            pos += n;
+        }
+        guard.lock();
+        b->used = 0;
+        spare.push_back(b);
+        if(!ok) {
+            failed = true;
+        }
+        cond.notify_all();
+    }
+}
+
+/**
+ * hand the full current buffer to the writer and take a free one. Only
+ * waits if the writer is a whole pool of buffers behind.
+ * @return false if recording had to stop
+ */
+bool CaptureWriter::next_buffer() {
+    std::unique_lock<std::mutex> guard(lock);
+    full.push_back(current);
+    current = nullptr;
+    cond.notify_all();
+    cond.wait(guard, [this]() { return !spare.empty() || failed; });
+    if(failed) {
+        return false;
+    }
+    current = spare.back();
+    spare.pop_back();
+    return true;
+}
+
+void CaptureWriter::write(const void *data, size_t length) {
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+    while(length && current) {
+        if(current->used == CHUNK && !next_buffer()) {
+            return;
+        }
+        size_t n = std::min(length, CHUNK - current->used);
+        std::memcpy(current->data.get() + current->used, src, n);
+        current->used += n;
+        src += n;
+        length -= n;
+    }
+}
+
+CaptureReader::CaptureReader() : fd(-1), map(nullptr), size(0), pos(0) {}
+
+CaptureReader::~CaptureReader() {
+    if(map) munmap(const_cast<uint8_t *>(map), size);
+    if(fd >= 0) ::close(fd);
+}
+
+bool CaptureReader::open(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(MAGIC)) {
+        return false;
+    }
+    size = st.st_size;
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED) {
+        size = 0;
+        return false;
+    }
+    map = static_cast<const uint8_t *>(p);
+    madvise(const_cast<uint8_t *>(map), size, MADV_SEQUENTIAL);
+    pos = sizeof(MAGIC);
+    return std::memcmp(map, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+bool CaptureReader::next(Record &rec) {
+    if(!map || pos + RECORD_HEADER > size) {
+        return false;
+    }
+    uint8_t d;
+    std::memcpy(&rec.timestamp_ns, map + pos, 8);
+    std::memcpy(&rec.length, map + pos + 8, 4);
+    std::memcpy(&d, map + pos + 12, 1);
+    // a zero length record can't be valid
+    if(rec.length == 0 || pos + RECORD_HEADER + rec.length > size) {
+        return false;
+    }
+    rec.dir = static_cast<CaptureDirection>(d);
+    rec.data = map + pos + RECORD_HEADER;
+    pos += RECORD_HEADER + rec.length;
+    return true;
+}
+
+}   // namespace detail
+}   // namespace mqpp
@@ -0,0 +1,139 @@
+/**
+ * Last value cache component for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <functional>
+
+#include "mqtt_311.h"
+#include "LastValueCache.h"
+
+namespace mqpp {
+namespace detail {
+
+LastValueCache::LastValueCache(size_t max_topics) : count(0) {
+    // keep the load factor below 1/2 so probe sequences stay short
+    size_t size = 16;
+    while(size < max_topics * 2) size <<= 1;
+    mask = size - 1;
+    slots.reset(new std::atomic<Entry *>[size]);
+    for(size_t i = 0; i < size; ++i) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+void LastValueCache::add_filter(const std::string &filter) {
+    filters.push_back(filter);
+}
+
+bool LastValueCache::matches(const std::string &topic) const {
+    for(const auto &filter : filters) {
+        if(protocol::topic_matches(filter, topic)) return true;
+    }
+    return false;
+}
+
+bool LastValueCache::update(const std::string &topic, const uint8_t *payload, size_t length) {
+    Entry *e = find(topic);
+    if(!e) {
+        e = insert(topic);
+        if(!e) return false;
+    }
+
+    Buffer *b = e->buf.load(std::memory_order_relaxed);
+    if(!b || b->capacity < length) {
+        std::unique_ptr<Buffer> nb(new Buffer());
+        nb->capacity = std::max<size_t>(std::max<size_t>(length, 64), b ? b->capacity * 2 : 0);
+        nb->data.reset(new char[nb->capacity]);
+        b = nb.get();
+        e->buffers.push_back(std::move(nb));
+    }
+
+    uint64_t seq = e->seq.load(std::memory_order_relaxed);
+    e->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(b->data.get(), payload, length);
+    e->buf.store(b, std::memory_order_relaxed);
+    e->len.store(length, std::memory_order_relaxed);
+    e->seq.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+uint64_t LastValueCache::read(const std::string &topic, std::string &payload) const {
+    const Entry *e = find(topic);
+    if(!e) return 0;
+
+    for(;;) {
+        uint64_t seq = e->seq.load(std::memory_order_acquire);
+        if(seq & 1) continue;   // update in progress
+
+        const Buffer *b = e->buf.load(std::memory_order_relaxed);
+        size_t len = e->len.load(std::memory_order_relaxed);
+        if(b) {
+            // buf and len may be torn if we raced, never read past the buffer
+            payload.assign(b->data.get(), std::min(len, b->capacity));
+        } else {
+            payload.clear();
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(e->seq.load(std::memory_order_relaxed) == seq) {
+            return seq / 2;
+        }
+    }
+}
+
+uint64_t LastValueCache::version(const std::string &topic) const {
+    const Entry *e = find(topic);
+    if(!e) return 0;
+    return e->seq.load(std::memory_order_acquire) / 2;
+}
+
+LastValueCache::Entry *LastValueCache::find(const std::string &topic) const {
+    size_t i = std::hash<std::string>()(topic) & mask;
+    for(;;) {
+        Entry *e = slots[i].load(std::memory_order_acquire);
+        if(!e || e->topic == topic) return e;
+        i = (i + 1) & mask;
+    }
+}
+
+LastValueCache::Entry *LastValueCache::insert(const std::string &topic) {
+    if((count + 1) * 2 > mask + 1) {
+        return nullptr;
+    }
+
+    std::unique_ptr<Entry> e(new Entry());
+    e->topic = topic;
+    e->seq.store(0, std::memory_order_relaxed);
+    e->buf.store(nullptr, std::memory_order_relaxed);
+    e->len.store(0, std::memory_order_relaxed);
+
+    size_t i = std::hash<std::string>()(topic) & mask;
+    while(slots[i].load(std::memory_order_relaxed)) {
+        i = (i + 1) & mask;
+    }
+    // publishing the pointer makes the fully built entry visible to readers
+    slots[i].store(e.get(), std::memory_order_release);
+    ++count;
+    entries.push_back(std::move(e));
+    return entries.back().get();
+}
+
+}   // namespace detail
+}   // namespace mqpp
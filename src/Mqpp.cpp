@@ -20,8 +20,13 @@
  * limitations under the License. 
  */
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
+#include <thread>
+
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "mqpp.h"
 #include "MqttSocket.h"
@@ -31,30 +36,80 @@ namespace mqpp {
 
 using namespace detail;
 
-    mqtt_client::Mqpp::Mqpp() : connstate(CONNSTATE::NOT_CONNECTED) {
+    mqtt_client::Mqpp::Mqpp() 
+        :   connstate(CONNSTATE::NOT_CONNECTED),
+            tx_lane(-1),
+            tx_offset(0),
+            tx_stalled(false),
+            replaying(false),
+            conflate_all(false),
+            last_packet_id(0),
+            max_packet_size(65536),
+            port(1883),
+            keepalive(20),
+            connect_timeout(10),
+            reconnect_first_delay(1),
+            reconnect_max_delay(64),
+            reconnect_delay(1),
+            reconnect_exponential(true),
+            qos_retry(10),
+            max_inflight_messages(0),
+            last_value_max_topics(4096),
+            instream()
+    {
+        for(int i = 0; i < LANES; ++i) {
+            lane_depth[i].store(0, std::memory_order_relaxed);
+        }
     }
 
     int mqtt_client::Mqpp::connect(    const std::string &host, 
                     const int port, 
                     const std::chrono::duration<int> keepalive,
-                    const std::string &bind_ip) 
+                    const std::string &bind_ip,
+                    const SocketOpts &sock_opts) 
     {
         // FIXME: what should happen if we are already connected etc?
-        SocketState res = sock.connect_socket(host, port, bind_ip);
+        this->host = host;
+        this->port = port;
+        this->keepalive = keepalive;
+        this->bind_ip = bind_ip;
+        this->sock_opts = sock_opts;
+        reconnect_delay = reconnect_first_delay;
+        timers.cancel(reconnect_timer);
+        sock.forget_addresses();
+        return start_connect();
+    }
+
+    /**
+     * start a (nonblocking) connection attempt. loop() watches the
+     * pending tcp connect and sends CONNECT once it is established,
+     * connect_timeout covers both stages.
+     */
+    int mqtt_client::Mqpp::start_connect() {
+        sock.close_socket();
+        SocketState res = sock.connect_socket(host, port, bind_ip, sock_opts);
         switch (res) {
             case SocketState::tcp_connected:
-                {
-                    protocol::Message msg("TestID", std::chrono::seconds(20), "", "", CleanSession::yes);
-                    if(sock.send(msg)) {
-                        log(LogLevel::warn, "Couldn't send CONNECT message (socket send failed)");
-                        return 1;
+            case SocketState::tcp_pending:
+                if(sock.failed_options()) {
+                    log(LogLevel::warn, "Couldn't apply " + std::to_string(sock.failed_options()) + " socket option(s)");
+                }
+                connstate = CONNSTATE::TCP_PENDING;
+                connect_timer = timers.arm(connect_timeout, [this]() {
+                    if(connstate == CONNSTATE::TCP_PENDING) {
+                        log(LogLevel::warn, "Connection attempt timed out (no TCP connection)");
+                        sock.connect_failed();
+                    } else {
+                        log(LogLevel::warn, "Connection attempt timed out (no CONNACK)");
                     }
-                    ctrl_event = std::chrono::steady_clock::now();
-                    connstate = CONNSTATE::CONNECTION_PENDING;
-                    log(LogLevel::info, "Sent CONNECT message, connstate is now pending");
-                    return 0;
+                    drop_connection(DisconnectReason::timeout);
+                    schedule_reconnect();
+                });
+                if(res == SocketState::tcp_connected) {
+                    return send_connect();
                 }
-                break;
+                log(LogLevel::info, "TCP connection pending");
+                return 0;
             case SocketState::resolv_error:
                 log(LogLevel::error, "Error extablishing connection: can't resolv hostname");
                 break;
@@ -63,80 +118,552 @@ using namespace detail;
                 break;
             case SocketState::connect_error:
                 log(LogLevel::error, "Error establishing TCP connection");
+                sock.connect_failed();
                 break;
         }
          
-
+        sock.close_socket();
+        schedule_reconnect();
         return 1;
     }
 
-    int mqtt_client::Mqpp::publish(std::string topic, std::string payload, QoS qos, Retain retain) {
-        if(connstate == CONNSTATE::CONNECTED) { // FIXME: allow this later, once we have a queue || CONNSTATE::CONNECTION_PENDING)
-            if(qos == QoS::at_most_once) {
-                protocol::Message msg(topic, payload, qos, retain);
-                sock.send(msg);
-                // FIXME: check mqtt spec: do we update the ping timer (ctrl_event) here?
-                return 0;
-            } else {
-                log(LogLevel::error, "QoS Not implemented yet!");
-                exit(1);
+    /**
+     * the tcp connection is up, send CONNECT. The fresh socket is empty,
+     * so it bypasses the lanes
+     */
+    int mqtt_client::Mqpp::send_connect() {
+        protocol::Message msg("TestID", keepalive, "", "", CleanSession::yes);
+        if(sock.send(msg) != static_cast<int>(msg.length())) {
+            log(LogLevel::warn, "Couldn't send CONNECT message (socket send failed)");
+            connect_failed();
+            return 1;
+        }
+        last_sent = std::chrono::steady_clock::now();
+        connstate = CONNSTATE::CONNECTION_PENDING;
+        log(LogLevel::info, "Sent CONNECT message, connstate is now pending");
+        return 0;
+    }
+
+    /** give up on a connection attempt that never got to CONNACK */
+    void mqtt_client::Mqpp::connect_failed() {
+        timers.cancel(connect_timer);
+        sock.close_socket();
+        connstate = CONNSTATE::NOT_CONNECTED;
+        schedule_reconnect();
+    }
+
+    void mqtt_client::Mqpp::set_reconnect_opts(int first_delay_s, int max_delay_s, bool exponential_delay) {
+        reconnect_first_delay = std::chrono::seconds(first_delay_s);
+        reconnect_max_delay = std::chrono::seconds(max_delay_s);
+        reconnect_exponential = exponential_delay;
+        reconnect_delay = reconnect_first_delay;
+    }
+
+    void mqtt_client::Mqpp::set_qos_opts(int retry_s, int max_inflight_messages) {
+        qos_retry = std::chrono::seconds(retry_s);
+        this->max_inflight_messages = max_inflight_messages;
+    }
+
+    void mqtt_client::Mqpp::set_last_value_cache_opts(size_t max_topics) {
+        if(last_values) {
+            log(LogLevel::warn, "Last value cache already in use, size not changed");
+            return;
+        }
+        last_value_max_topics = max_topics;
+    }
+
+    void mqtt_client::Mqpp::add_last_value_filter(const std::string &filter) {
+        if(!last_values) {
+            last_values.reset(new LastValueCache(last_value_max_topics));
+        }
+        last_values->add_filter(filter);
+    }
+
+    void mqtt_client::Mqpp::set_conflation_opts(bool conflate_all) {
+        this->conflate_all = conflate_all;
+    }
+
+    void mqtt_client::Mqpp::add_conflation_filter(const std::string &filter) {
+        conflation_filters.push_back(filter);
+    }
+
+    bool mqtt_client::Mqpp::conflates(const std::string &topic) const {
+        if(conflate_all) return true;
+        for(const auto &filter : conflation_filters) {
+            if(protocol::topic_matches(filter, topic)) return true;
+        }
+        return false;
+    }
+
+    int mqtt_client::Mqpp::publish(std::string topic, std::string payload, QoS qos, Retain retain, Lane lane) {
+        if(!protocol::valid_topic_name(topic)) {
+            log(LogLevel::error, "Not publishing, invalid topic name");
+            return -1;
+        }
+        if(2 + topic.size() + payload.size() > protocol::MAX_REMAINING_LENGTH) {
+            log(LogLevel::error, "Not publishing, payload too large");
+            return -1;
+        }
+        if(qos == QoS::at_most_once) {
+            // publishes are queued in any state and go out once connected
+            if(lane == Lane::control) {
+                // reserved for protocol packets, publishes can't overtake them
+                lane = Lane::high;
+            }
+            int l = static_cast<int>(lane);
+            if(!conflated.empty()) {
+                // replace a still unsent message on this topic in place,
+                // or move it to the back of the lane it is published on now
+                auto it = conflated.find(topic);
+                if(it != conflated.end()) {
+                    ConflatedEntry &entry = it->second;
+                    entry.message->msg = protocol::Message(topic, payload, qos, retain);
+                    if(entry.lane != l) {
+                        outqueue[l].splice(outqueue[l].end(), outqueue[entry.lane], entry.message);
+                        lane_depth[entry.lane].fetch_sub(1, std::memory_order_relaxed);
+                        lane_depth[l].fetch_add(1, std::memory_order_relaxed);
+                        entry.lane = l;
+                        flush_outqueue();
+                    }
+                    return 0;
+                }
+            }
+            bool conflate = conflates(topic);
+            enqueue(lane, OutboundMessage{protocol::Message(topic, payload, qos, retain), conflate ? topic : std::string(), conflate, nullptr});
+            if(conflate) {
+                conflated[topic] = ConflatedEntry{l, std::prev(outqueue[l].end())};
             }
+            flush_outqueue();
+            return 0;
         } else {
+            log(LogLevel::error, "QoS Not implemented yet!");
+            exit(1);
+        }
+    }
+
+    /**
+     * queue a publish whose body stays in a file or pipe. The headers are
+     * a normal message, flush_outqueue() sends the body from fd.
+     */
+    int mqtt_client::Mqpp::publish_file(std::string topic, int fd, uint64_t offset, size_t length, QoS qos, Retain retain, Lane lane) {
+        if(!protocol::valid_topic_name(topic)) {
+            log(LogLevel::error, "Not publishing, invalid topic name");
+            return -1;
+        }
+        if(2 + topic.size() + length > protocol::MAX_REMAINING_LENGTH) {
+            log(LogLevel::error, "Not publishing, payload too large");
+            return -1;
+        }
+        if(qos != QoS::at_most_once) {
+            log(LogLevel::error, "QoS Not implemented yet!");
+            return -1;
+        }
+        struct stat st;
+        if(fstat(fd, &st)) {
+            log(LogLevel::error, "Not publishing, bad file descriptor");
             return -1;
         }
+        bool pipe = S_ISFIFO(st.st_mode);
+        if(!pipe && !S_ISREG(st.st_mode)) {
+            log(LogLevel::error, "Not publishing, only regular files and pipes can be sent");
+            return -1;
+        }
+        if(!pipe && offset + length > static_cast<uint64_t>(st.st_size)) {
+            log(LogLevel::error, "Not publishing, file is shorter than offset + length");
+            return -1;
+        }
+        int body_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if(body_fd < 0) {
+            log(LogLevel::error, "Not publishing, can't duplicate file descriptor");
+            return -1;
+        }
+        if(lane == Lane::control) {
+            lane = Lane::high;
+        }
+        std::shared_ptr<FileBody> body = std::make_shared<FileBody>(body_fd, offset, length, pipe);
+        enqueue(lane, OutboundMessage{protocol::Message(topic, length, qos, retain), std::string(), false, body});
+        flush_outqueue();
+        return 0;
     }
 
-    int mqtt_client::Mqpp::loop() {
-        // first receive inbound messages
-        switch(connstate) {
-            case CONNSTATE::CONNECTION_PENDING: 
-            case CONNSTATE::CONNECTED:
-            case CONNSTATE::PING_PENDING:
-                    if(sock.receive(inqueue)) {
-                        log(LogLevel::trace, "Received and enqueued a Message from the Broker");
-                    }
+    int mqtt_client::Mqpp::subscribe(const std::vector<std::pair<std::string, QoS>> &filters) {
+        std::shared_ptr<SubscribeRequest> req(new SubscribeRequest());
+        req->unsubscribe = false;
+        req->resubscribe = false;
+        req->pending_packets = 0;
+        req->next_filter = 0;
+        if(filters.empty()) {
+            log(LogLevel::error, "Not subscribing, no topic filters given");
+            return -1;
+        }
+        req->filters.reserve(filters.size());
+        req->qos.reserve(filters.size());
+        bool valid = true;
+        for(const auto &f : filters) {
+            if(!protocol::valid_topic_filter(f.first)) {
+                log(LogLevel::error, "Not subscribing, invalid topic filter " + f.first);
+                valid = false;
+            }
+            req->filters.push_back(f.first);
+            req->qos.push_back(f.second);
+        }
+        req->results.assign(filters.size(), SubscribeResult::failure);
+        if(!valid) {
+            // the batch is rejected as a whole, but still completes
+            if(subscribe_callback) {
+                subscribe_callback(req->filters, req->results);
+            }
+            return -1;
+        }
+        requests.push_back(req);
+        // otherwise sent once connected
+        if(connstate == CONNSTATE::CONNECTED || connstate == CONNSTATE::PING_PENDING) {
+            send_request(req);
+        }
+        return 0;
+    }
+
+    int mqtt_client::Mqpp::unsubscribe(const std::vector<std::string> &filters) {
+        if(filters.empty()) {
+            log(LogLevel::error, "Not unsubscribing, no topic filters given");
+            return -1;
+        }
+        for(const auto &f : filters) {
+            if(!protocol::valid_topic_filter(f)) {
+                log(LogLevel::error, "Not unsubscribing, invalid topic filter " + f);
+                return -1;
+            }
+        }
+        std::shared_ptr<SubscribeRequest> req(new SubscribeRequest());
+        req->unsubscribe = true;
+        req->resubscribe = false;
+        req->pending_packets = 0;
+        req->next_filter = 0;
+        req->filters = filters;
+
+        // forget them right away, also when a pending subscribe for
+        // them completes later
+        for(const auto &f : filters) {
+            subscriptions.erase(f);
+        }
+        for(auto &pending : requests) {
+            if(!pending->unsubscribe) {
+                pending->cancelled.insert(filters.begin(), filters.end());
+            }
+        }
+
+        requests.push_back(req);
+        if(connstate == CONNSTATE::CONNECTED || connstate == CONNSTATE::PING_PENDING) {
+            send_request(req);
+        }
+        return 0;
+    }
+
+    /** @return a free packet identifier, 0 if all are in use */
+    uint16_t mqtt_client::Mqpp::next_packet_id() {
+        for(int tries = 0; tries < 65535; ++tries) {
+            if(++last_packet_id == 0) {
+                last_packet_id = 1;
+            }
+            if(!pending_acks.count(last_packet_id)) {
+                return last_packet_id;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * pack the filters of a request into as few packets as max_packet_size
+     * allows and queue them all at once
+     */
+    void mqtt_client::Mqpp::send_request(const std::shared_ptr<SubscribeRequest> &req) {
+        if(replaying) {
+            return;
+        }
+        req->pending_packets = 0;
+        req->next_filter = 0;
+        send_packets(req);
+        flush_outqueue();
+    }
+
+    /**
+     * queue packets for the filters of a request not sent yet. If packet
+     * identifiers run out, the rest waits for acks to free some.
+     * @return true if all filters are sent now
+     */
+    bool mqtt_client::Mqpp::send_packets(const std::shared_ptr<SubscribeRequest> &req) {
+        const std::vector<std::string> &filters = req->filters;
+        size_t start = req->next_filter;
+        size_t packets = 0;
+        size_t i = start;
+        while(i < filters.size()) {
+            uint16_t id = next_packet_id();
+            if(!id) {
                 break;
-            default:
+            }
+            size_t first = i;
+            size_t remlength = 2;   // packet identifier
+            while(i < filters.size()) {
+                size_t add = 2 + filters[i].size() + (req->unsubscribe ? 0 : 1);
+                // 5 = max fixed header size, a single oversized filter still gets its own packet
+                if(i > first && 5 + remlength + add > max_packet_size) break;
+                remlength += add;
+                ++i;
+            }
+
+            protocol::Message msg(req->unsubscribe ? protocol::MsgType::unsubscribe : protocol::MsgType::subscribe, id, remlength);
+            for(size_t k = first; k < i; ++k) {
+                msg.append_string(filters[k]);
+                if(!req->unsubscribe) {
+                    msg.append_byte(static_cast<uint8_t>(req->qos[k]) >> 1);
+                }
+            }
+            pending_acks[id] = RequestPacket{req, first, i - first};
+            ++req->pending_packets;
+            ++packets;
+            enqueue(Lane::control, OutboundMessage{std::move(msg), std::string(), false, nullptr});
+        }
+        req->next_filter = i;
+        if(packets) {
+            // resumed requests trickle out one packet per ack, keep those quiet
+            log(start ? LogLevel::trace : LogLevel::info, "Sent " + std::to_string(i - start) + " filters in "
+                    + std::to_string(packets) + (req->unsubscribe ? " UNSUBSCRIBE" : " SUBSCRIBE") + " packet(s)");
+        }
+        if(i < filters.size()) {
+            if(!start) {
+                log(LogLevel::warn, "Out of packet identifiers, holding back " + std::to_string(filters.size() - i) + " filters");
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void mqtt_client::Mqpp::handle_subscribe_ack(const protocol::Message &msg) {
+        auto it = pending_acks.find(msg.packet_id());
+        if(it == pending_acks.end()) {
+            log(LogLevel::warn, "Received SUBACK / UNSUBACK for unknown packet identifier");
+            return;
+        }
+        RequestPacket packet = it->second;
+        pending_acks.erase(it);
+
+        SubscribeRequest &req = *packet.request;
+        if(!req.unsubscribe) {
+            // return codes follow the packet identifier
+            size_t pos = msg.header_length() + 2;
+            for(size_t k = 0; k < packet.count; ++k) {
+                if(pos + k < msg.length()) {
+                    req.results[packet.first + k] = static_cast<SubscribeResult>(msg.data()[pos + k]);
+                }
+            }
+        }
+        if(--req.pending_packets == 0 && req.next_filter == req.filters.size()) {
+            complete_request(packet.request);
+        }
+
+        // an identifier is free again, go on with held back filters
+        for(auto &pending : requests) {
+            if(pending->next_filter < pending->filters.size() && !send_packets(pending)) {
                 break;
+            }
+        }
+    }
+
+    void mqtt_client::Mqpp::complete_request(const std::shared_ptr<SubscribeRequest> &req) {
+        requests.remove(req);
+        if(req->unsubscribe) {
+            if(unsubscribe_callback) {
+                unsubscribe_callback(req->filters);
+            }
+            return;
         }
 
-        // then check pending (outbound) qos message epochs
-        
-        // then check timer events
-        auto now = std::chrono::steady_clock::now();
-        auto ctrl_timer = now - ctrl_event;
+        size_t failed = 0;
+        for(size_t i = 0; i < req->filters.size(); ++i) {
+            const std::string &filter = req->filters[i];
+            if(req->results[i] == SubscribeResult::failure) {
+                subscriptions.erase(filter);
+                ++failed;
+            } else if(!req->cancelled.count(filter)) {
+                subscriptions[filter] = req->qos[i];
+            }
+        }
+        if(req->resubscribe) {
+            if(failed) {
+                log(LogLevel::warn, "Broker refused " + std::to_string(failed) + " filter(s) when resubscribing");
+            }
+        } else if(subscribe_callback) {
+            subscribe_callback(req->filters, req->results);
+        }
+    }
+
+    /**
+     * called once CONNACK arrived. We always connect with a clean session,
+     * so the broker has forgotten all subscriptions: restore the active
+     * ones in one bulk request and (re)send the pending user requests.
+     */
+    void mqtt_client::Mqpp::restore_subscriptions() {
+        if(replaying) {
+            return;
+        }
+        std::list<std::shared_ptr<SubscribeRequest>> pending;
+        pending.swap(requests);
+
+        if(!subscriptions.empty()) {
+            std::shared_ptr<SubscribeRequest> req(new SubscribeRequest());
+            req->unsubscribe = false;
+            req->resubscribe = true;
+            req->pending_packets = 0;
+            req->next_filter = 0;
+            req->filters.reserve(subscriptions.size());
+            req->qos.reserve(subscriptions.size());
+            for(const auto &sub : subscriptions) {
+                req->filters.push_back(sub.first);
+                req->qos.push_back(sub.second);
+            }
+            req->results.assign(req->filters.size(), SubscribeResult::failure);
+            requests.push_back(req);
+            send_request(req);
+        }
+
+        // filters of the subscribe requests sent again below, a later
+        // unsubscribe of one of them has to follow them to the broker
+        std::unordered_set<std::string> resent;
+        for(auto &req : pending) {
+            if(req->resubscribe) {
+                // superseded by the new resubscribe above
+                continue;
+            }
+            if(req->unsubscribe) {
+                bool needed = false;
+                for(const auto &f : req->filters) {
+                    needed = needed || resent.count(f);
+                }
+                if(!needed) {
+                    // nothing to unsubscribe from in a clean session
+                    if(unsubscribe_callback) {
+                        unsubscribe_callback(req->filters);
+                    }
+                    continue;
+                }
+            } else {
+                resent.insert(req->filters.begin(), req->filters.end());
+            }
+            requests.push_back(req);
+            send_request(req);
+        }
+    }
+
+    int mqtt_client::Mqpp::loop(std::chrono::milliseconds max_wait) {
+        // wait for inbound data, but not past the next timer. In spin
+        // polling mode we never block and leave the pacing to the caller
+        if(!sock_opts.spin_poll && max_wait.count() > 0 && inqueue.empty()) {
+            auto now = std::chrono::steady_clock::now();
+            auto wakeup = std::min(now + max_wait, timers.next_deadline());
+            if(wakeup > now) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now);
+                if(wait < wakeup - now) ++wait;
+                // a frame stalled on its pipe resumes once the pipe has data
+                int wait_fd = tx_stalled ? outqueue[tx_lane].front().body->fd : -1;
+                sock.wait_ready(wait.count(), connstate == CONNSTATE::TCP_PENDING || flushable(), wait_fd);
+            }
+        }
+
+        // first receive inbound messages, or finish a pending connect
         switch(connstate) {
-            case CONNSTATE::CONNECTION_PENDING: 
-            case CONNSTATE::PING_PENDING:
-                if (ctrl_timer > std::chrono::seconds(1)) {
-                    log(LogLevel::warn, "Connection attempts timed out (no CONNACK)");
-                    exit(1);
+            case CONNSTATE::TCP_PENDING:
+                switch(sock.connect_result()) {
+                    case 1:
+                        log(LogLevel::info, "TCP connection established");
+                        send_connect();
+                        break;
+                    case -1:
+                        log(LogLevel::error, "Error establishing TCP connection");
+                        sock.connect_failed();
+                        connect_failed();
+                        break;
+                    default:
+                        break;
                 }
                 break;
+            case CONNSTATE::CONNECTION_PENDING: 
             case CONNSTATE::CONNECTED:
-                if(ctrl_timer > std::chrono::seconds(5)) {
-                    log(LogLevel::info, "Sending PINGREQ");
-                    ctrl_event = now;
-                    sock.send(protocol::Message());
+            case CONNSTATE::PING_PENDING:
+                // drain what is pending, but bounded, so timers and the
+                // outbound lanes still get their turn under a flood
+                for(int reads = 0; reads < MAX_READS_PER_LOOP; ++reads) {
+                    int res = sock.receive(inqueue);
+                    if(res == -1) {
+                        log(LogLevel::warn, "Connection closed by broker or socket error");
+                        drop_connection(DisconnectReason::socket_error);
+                        schedule_reconnect();
+                        break;
+                    }
+                    if(res == -2) {
+                        log(LogLevel::error, "Received malformed frame");
+                        drop_connection(DisconnectReason::protocol_error);
+                        schedule_reconnect();
+                        break;
+                    }
+                    if(res == 0) {
+                        break;
+                    }
+                    log(LogLevel::trace, "Received and enqueued a Message from the Broker");
                 }
                 break;
             default:
                 break;
         }
+
+        // then fire expired timers (keepalive, connect timeout, qos
+        // retries, reconnect backoff)
+        timers.advance(std::chrono::steady_clock::now());
+
         // then serve outbound msg queue
-        // FIXME: currently not necessary/implemented, since outbound
-        // messages are sent directly without enqueuing, blocking the caller.
-        // This will be fixed later
+        flush_outqueue();
 
         // finally serve global event queue
-        if(!inqueue.empty()) {
-            protocol::Message msg = inqueue.front();
+        process_inqueue();
+        return 0;
+    }
+
+    void mqtt_client::Mqpp::process_inqueue() {
+        finish_stream();
+        while(!inqueue.empty()) {
+            protocol::Message msg = std::move(inqueue.front());
             inqueue.pop_front();
+            switch(msg.type()) {
+                case protocol::MsgType::publish:
+                    handle_publish(msg);
+                    continue;
+                case protocol::MsgType::pubrel:
+                    qos2_received.erase(msg.packet_id());
+                    send(protocol::Message(protocol::MsgType::pubcomp, msg.packet_id(), 2));
+                    continue;
+                case protocol::MsgType::suback:
+                case protocol::MsgType::unsuback:
+                    handle_subscribe_ack(msg);
+                    continue;
+                default:
+                    break;
+            }
             switch(connstate) {
                 case CONNSTATE::CONNECTION_PENDING: {
                     switch(msg.type()) {
                         case protocol::MsgType::connack: {
+                            int code = msg.length() >= 4 ? msg.data()[3] : -1;
+                            if(code != 0) {
+                                // refused, retried with the backoff still growing
+                                log(LogLevel::error, "Connection refused by broker, CONNACK return code " + std::to_string(code));
+                                connect_failed();
+                                inqueue.clear();
+                                return;
+                            }
                             connstate = CONNSTATE::CONNECTED;
+                            timers.cancel(connect_timer);
+                            reconnect_delay = reconnect_first_delay;
+                            arm_keepalive();
+                            restore_subscriptions();
                             if(connect_status_callback) {
                                 connect_status_callback(ConnectionState::open, DisconnectReason::none);
                             }
@@ -154,17 +681,385 @@ using namespace detail;
                     switch(msg.type()) {
                         case protocol::MsgType::pingresp: {
                             connstate = CONNSTATE::CONNECTED;
+                            timers.cancel(keepalive_timer);
+                            arm_keepalive();
                         }
                         break;
                         default: {
-                            log(LogLevel::warn, "Unexpected Message in CONNECTION_PENDING state");
+                            log(LogLevel::warn, "Unexpected Message in PING_PENDING state");
                         }
                     }
                 }
                 break;
+                default:
+                break;
             }
         }
-        return 0;
+    }
+
+    void mqtt_client::Mqpp::start_capture(const std::string &path) {
+        if(!sock.start_capture(path)) {
+            log(LogLevel::error, "Can't create capture file " + path);
+        }
+    }
+
+    void mqtt_client::Mqpp::stop_capture() {
+        sock.stop_capture();
+    }
+
+    /**
+     * feed the inbound frames of a capture through the receive and
+     * dispatch path. Nothing is sent while replaying and timers armed
+     * by the replayed traffic are cancelled afterwards.
+     */
+    int mqtt_client::Mqpp::replay(const std::string &path, bool realtime) {
+        if(connstate != CONNSTATE::NOT_CONNECTED) {
+            // replay takes over connstate, receive buffer and timers
+            log(LogLevel::error, "Not replaying, client is connected or connecting");
+            return -1;
+        }
+        CaptureReader reader;
+        if(!reader.open(path)) {
+            log(LogLevel::error, "Can't read capture file " + path);
+            return -1;
+        }
+
+        replaying = true;
+        connstate = CONNSTATE::CONNECTION_PENDING;
+
+        int frames = 0;
+        CaptureReader::Record rec;
+        auto start = std::chrono::steady_clock::now();
+        uint64_t first_ts = 0;
+        bool first = true;
+        while(reader.next(rec)) {
+            if(rec.dir != CaptureDirection::inbound) continue;
+            if(realtime) {
+                if(first) first_ts = rec.timestamp_ns;
+                first = false;
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(rec.timestamp_ns - first_ts));
+            }
+            int res = sock.inject(rec.data, rec.length, inqueue);
+            if(res < 0) {
+                log(LogLevel::error, "Malformed frame in capture, replay stopped");
+                break;
+            }
+            frames += res;
+            process_inqueue();
+        }
+
+        timers.cancel(keepalive_timer);
+        timers.cancel(connect_timer);
+        // a capture may end inside a frame or a streamed payload, don't
+        // let that leak into the next replay or connection
+        sock.close_socket();
+        instream = InboundStream();
+        inqueue.clear();
+        connstate = CONNSTATE::NOT_CONNECTED;
+        replaying = false;
+        return frames;
+    }
+
+    void mqtt_client::Mqpp::handle_publish(const protocol::Message &msg) {
+        std::string topic = msg.topic();
+        if(!protocol::valid_topic_name(topic)) {
+            log(LogLevel::error, "Received publish with invalid topic name");
+            if(!replaying) {
+                drop_connection(DisconnectReason::protocol_error);
+                schedule_reconnect();
+            } else if(msg.truncated()) {
+                // still consume the payload to stay in sync with the capture
+                start_stream(msg, true);
+            }
+            return;
+        }
+        if(msg.truncated()) {
+            start_stream(msg, false);
+            return;
+        }
+        switch(msg.qos()) {
+            case QoS::at_least_once:
+                send(protocol::Message(protocol::MsgType::puback, msg.packet_id(), 2));
+                break;
+            case QoS::exactly_once: {
+                bool redelivery = !qos2_received.insert(msg.packet_id()).second;
+                send(protocol::Message(protocol::MsgType::pubrec, msg.packet_id(), 2));
+                if(redelivery) {
+                    // already handed on before the broker got our PUBREC
+                    return;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        if(last_values) {
+            if(last_values->matches(topic) && !last_values->update(topic, msg.payload(), msg.payload_length())) {
+                log(LogLevel::warn, "Last value cache full, not caching " + topic);
+            }
+        }
+    }
+
+    void mqtt_client::Mqpp::set_stream_callback(const std::function<void(const std::string &, const uint8_t *, size_t, size_t, size_t)> &cb, size_t min_length) {
+        stream_callback = cb;
+        sock.set_stream(cb ? std::max<size_t>(min_length, 1) : 0, [this](const uint8_t *data, size_t length) {
+            on_stream_data(data, length);
+        });
+    }
+
+    /**
+     * the headers of a streamed publish came in, hand on its payload as
+     * the socket delivers it. The ack goes out after the last piece.
+     */
+    void mqtt_client::Mqpp::start_stream(const protocol::Message &msg, bool skip) {
+        instream.topic = msg.topic();
+        instream.qos = msg.qos();
+        instream.packet_id = msg.packet_id();
+        instream.offset = 0;
+        instream.total = sock.stream_length();
+        instream.active = true;
+        // a redelivery was already handed on before the broker got our PUBREC
+        instream.skip = skip || (instream.qos == QoS::exactly_once && qos2_received.count(instream.packet_id));
+        if(sock.begin_stream(inqueue) < 0) {
+            log(LogLevel::error, "Received malformed frame");
+            if(!replaying) {
+                drop_connection(DisconnectReason::protocol_error);
+                schedule_reconnect();
+            }
+            return;
+        }
+        finish_stream();
+    }
+
+    void mqtt_client::Mqpp::on_stream_data(const uint8_t *data, size_t length) {
+        if(!instream.skip && stream_callback) {
+            stream_callback(instream.topic, data, length, instream.offset, instream.total);
+        }
+        instream.offset += length;
+    }
+
+    void mqtt_client::Mqpp::finish_stream() {
+        if(!instream.active || instream.offset < instream.total) {
+            return;
+        }
+        instream.active = false;
+        switch(instream.qos) {
+            case QoS::at_least_once:
+                send(protocol::Message(protocol::MsgType::puback, instream.packet_id, 2));
+                break;
+            case QoS::exactly_once:
+                qos2_received.insert(instream.packet_id);
+                send(protocol::Message(protocol::MsgType::pubrec, instream.packet_id, 2));
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * send a control packet. It goes into the control lane, so it only
+     * waits for the frame that is currently on the wire.
+     * @return -1 if the connection was dropped
+     */
+    int mqtt_client::Mqpp::send(const protocol::Message &msg) {
+        if(replaying) {
+            return 0;
+        }
+        enqueue(Lane::control, OutboundMessage{msg, std::string(), false, nullptr});
+        return flush_outqueue();
+    }
+
+    void mqtt_client::Mqpp::enqueue(Lane lane, OutboundMessage &&msg) {
+        int l = static_cast<int>(lane);
+        outqueue[l].push_back(std::move(msg));
+        lane_depth[l].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * true if there is something we may send right now. Before CONNACK
+     * only the control lane is served, publishes wait for the session.
+     */
+    bool mqtt_client::Mqpp::flushable() const {
+        if(tx_stalled) {
+            // nothing else can go before the half sent frame
+            return false;
+        }
+        switch(connstate) {
+            case CONNSTATE::CONNECTED:
+            case CONNSTATE::PING_PENDING:
+                for(int l = 0; l < LANES; ++l) {
+                    if(!outqueue[l].empty()) return true;
+                }
+                return false;
+            case CONNSTATE::CONNECTION_PENDING:
+                return !outqueue[static_cast<int>(Lane::control)].empty();
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * send queued messages until the lanes are empty or the socket
+     * buffer is full. At every frame boundary the next message is taken
+     * from the highest priority lane that has one.
+     * @return -1 if the connection was dropped
+     */
+    int mqtt_client::Mqpp::flush_outqueue() {
+        if(replaying) {
+            return 0;
+        }
+        int lanes = 0;
+        switch(connstate) {
+            case CONNSTATE::CONNECTED:
+            case CONNSTATE::PING_PENDING:
+                lanes = LANES;
+                break;
+            case CONNSTATE::CONNECTION_PENDING:
+                lanes = 1;
+                break;
+            default:
+                break;
+        }
+
+        for(;;) {
+            if(tx_lane < 0) {
+                for(int l = 0; l < lanes && tx_lane < 0; ++l) {
+                    if(!outqueue[l].empty()) tx_lane = l;
+                }
+                if(tx_lane < 0) {
+                    return 0;
+                }
+            }
+
+            OutboundMessage &front = outqueue[tx_lane].front();
+            size_t header = front.msg.length();
+            int sent;
+            if(tx_offset < header) {
+                sent = sock.send(front.msg, tx_offset, front.body != nullptr);
+            } else {
+                sent = sock.send_file(*front.body, tx_offset - header);
+            }
+            tx_stalled = sent == -3;
+            if(tx_stalled) {
+                return 0;
+            }
+            if(sent == -2) {
+                // the broker expects the announced length, the frame can
+                // only be ended by closing the connection
+                log(LogLevel::error, "File ended before the publish body was sent, dropping it");
+                outqueue[tx_lane].pop_front();
+                lane_depth[tx_lane].fetch_sub(1, std::memory_order_relaxed);
+                tx_lane = -1;
+                tx_offset = 0;
+                drop_connection(DisconnectReason::socket_error);
+                schedule_reconnect();
+                return -1;
+            }
+            if(sent < 0) {
+                log(LogLevel::warn, "Socket send failed");
+                drop_connection(DisconnectReason::socket_error);
+                schedule_reconnect();
+                return -1;
+            }
+            if(sent > 0) {
+                // only progress counts, a blocked socket must let the
+                // keepalive ping (and time out) a stalled broker
+                last_sent = std::chrono::steady_clock::now();
+                if(front.conflated) {
+                    // once sending has started the message can't be replaced anymore
+                    conflated.erase(front.topic);
+                    front.conflated = false;
+                }
+            }
+            tx_offset += sent;
+            if(tx_offset == 0) {
+                // nothing went out, so this is still a frame boundary: a
+                // control packet queued meanwhile may go first next time
+                tx_lane = -1;
+                return 0;
+            }
+            if(tx_offset < header + (front.body ? front.body->length : 0)) {
+                // the socket buffer is full, unless the headers just went out
+                if(sent == 0 || tx_offset < header) {
+                    return 0;
+                }
+                continue;
+            }
+            outqueue[tx_lane].pop_front();
+            lane_depth[tx_lane].fetch_sub(1, std::memory_order_relaxed);
+            tx_lane = -1;
+            tx_offset = 0;
+        }
+    }
+
+    /**
+     * arm the keepalive timer for one keepalive period after the last
+     * sent packet. The timer is not re-armed on every send, instead it
+     * re-arms itself on expiry if traffic was sent in the meantime.
+     */
+    void mqtt_client::Mqpp::arm_keepalive() {
+        if(keepalive.count() == 0) return;
+        keepalive_timer = timers.arm(last_sent + keepalive, [this]() { on_keepalive(); });
+    }
+
+    void mqtt_client::Mqpp::on_keepalive() {
+        if(std::chrono::steady_clock::now() - last_sent < keepalive) {
+            arm_keepalive();
+            return;
+        }
+        log(LogLevel::info, "Sending PINGREQ");
+        if(send(protocol::Message())) {
+            return;
+        }
+        connstate = CONNSTATE::PING_PENDING;
+        keepalive_timer = timers.arm(keepalive, [this]() {
+            log(LogLevel::warn, "Connection timed out (no PINGRESP)");
+            drop_connection(DisconnectReason::timeout);
+            schedule_reconnect();
+        });
+    }
+
+    void mqtt_client::Mqpp::drop_connection(DisconnectReason reason) {
+        timers.cancel(keepalive_timer);
+        timers.cancel(connect_timer);
+        timers.cancel(reconnect_timer);
+        sock.close_socket();
+        inqueue.clear();
+        instream.active = false;
+        // a half sent message goes out again from the start, control
+        // packets belong to the old connection and are dropped.
+        // Unacknowledged (un)subscribe requests are re-sent on reconnect.
+        // A pipe can't be rewound, a body cut off from it is lost
+        if(tx_lane >= 0 && tx_offset > 0 && outqueue[tx_lane].front().body && outqueue[tx_lane].front().body->pipe) {
+            log(LogLevel::warn, "Connection lost while sending from a pipe, dropping that publish");
+            outqueue[tx_lane].pop_front();
+            lane_depth[tx_lane].fetch_sub(1, std::memory_order_relaxed);
+        }
+        tx_lane = -1;
+        tx_offset = 0;
+        tx_stalled = false;
+        outqueue[static_cast<int>(Lane::control)].clear();
+        lane_depth[static_cast<int>(Lane::control)].store(0, std::memory_order_relaxed);
+        pending_acks.clear();
+        qos2_received.clear();
+        connstate = CONNSTATE::NOT_CONNECTED;
+        if(connect_status_callback) {
+            connect_status_callback(ConnectionState::closed, reason);
+        }
+    }
+
+    void mqtt_client::Mqpp::schedule_reconnect() {
+        log(LogLevel::info, "Reconnecting in " + std::to_string(reconnect_delay.count()) + "s");
+        timers.cancel(reconnect_timer);
+        reconnect_timer = timers.arm(reconnect_delay, [this]() { start_connect(); });
+        if(reconnect_exponential) {
+            reconnect_delay *= 2;
+        } else {
+            reconnect_delay += reconnect_first_delay;
+        }
+        if(reconnect_delay > reconnect_max_delay) {
+            reconnect_delay = reconnect_max_delay;
+        }
     }
 
     void mqtt_client::Mqpp::log(LogLevel lvl, std::string text) {
@@ -20,6 +20,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <thread>
 #include <chrono>
@@ -31,80 +41,346 @@ namespace detail {
 
 using namespace std;
 
-MqttSocket::MqttSocket() : sock(-1) {}
+MqttSocket::MqttSocket()
+    : sock(-1), resolved_port(0), next_address(0), stream_threshold(0), stream_remaining(0), stream_started(false), option_errors(0) {}
 
 SocketState MqttSocket::connect_socket( const std::string &host, 
                                 const int port, 
-                                const std::string &bind_ip) 
+                                const std::string &bind_ip,
+                                const SocketOpts &opts) 
 {
-    int status;
-    struct addrinfo hints {};
-    struct addrinfo *servinf;
+    this->opts = opts;
+    option_errors = 0;
+
+    if(addresses.empty() || host != resolved_host || port != resolved_port) {
+        struct addrinfo hints {};
+        struct addrinfo *servinf;
 
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
 
-    status = getaddrinfo(host.c_str(), "1883", &hints, &servinf);
-    if(status != 0) {
-        return(SocketState::resolv_error);
+        addresses.clear();
+        if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &servinf) != 0) {
+            return(SocketState::resolv_error);
+        }
+        for(struct addrinfo *ai = servinf; ai; ai = ai->ai_next) {
+            Address a {};
+            a.family = ai->ai_family;
+            a.socktype = ai->ai_socktype;
+            a.protocol = ai->ai_protocol;
+            std::memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+            a.addrlen = ai->ai_addrlen;
+            addresses.push_back(a);
+        }
+        freeaddrinfo(servinf);
+        if(addresses.empty()) {
+            return(SocketState::resolv_error);
+        }
+        resolved_host = host;
+        resolved_port = port;
+        next_address = 0;
     }
-    // FIXME: Do proper error handling
-    // FIXME: Walk through linked list of servinf's and look for
-    //          valid entries instead of assuming the first entry
-    //          is valid
+    const Address &a = addresses[next_address % addresses.size()];
 
-    sock = socket(servinf->ai_family, servinf->ai_socktype, servinf->ai_protocol);
+    sock = socket(a.family, a.socktype, a.protocol);
     if (sock < 0) {
         return(SocketState::socket_error);
     }
 
+    apply_options();
     set_nonblock(sock);
 
-    status = ::connect(sock, servinf->ai_addr, servinf->ai_addrlen);
-    if(status != 0) {
-        return(SocketState::connect_error);
+    if(::connect(sock, reinterpret_cast<const sockaddr *>(&a.addr), a.addrlen) == 0) {
+        return SocketState::tcp_connected;
+    }
+    if(errno == EINPROGRESS) {
+        return SocketState::tcp_pending;
     }
-    // FIXME: Do proper Error Handling
+    return(SocketState::connect_error);
+}
+
+int MqttSocket::connect_result() {
+    struct pollfd pfd {};
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
+    if(poll(&pfd, 1, 0) <= 0) {
+        return 0;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        return -1;
+    }
+    return 1;
+}
 
-    return SocketState::tcp_connected;
+void MqttSocket::apply_options() {
+    int one = 1;
+    if(opts.tcp_nodelay) {
+        if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) ++option_errors;
+    }
+    if(opts.tcp_quickack) {
+        if(setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one))) ++option_errors;
+    }
+    if(opts.sndbuf > 0) {
+        if(setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opts.sndbuf, sizeof(opts.sndbuf))) ++option_errors;
+    }
+    if(opts.rcvbuf > 0) {
+        if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opts.rcvbuf, sizeof(opts.rcvbuf))) ++option_errors;
+    }
+    if(opts.busy_poll_us > 0) {
+        if(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &opts.busy_poll_us, sizeof(opts.busy_poll_us))) ++option_errors;
+    }
+    if(opts.cpu >= 0) {
+        // hint only: steers flow processing towards this cpu, the thread
+        // that connects is expected to be the one running the loop
+        if(setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &opts.cpu, sizeof(opts.cpu))) ++option_errors;
+        if(opts.cpu < CPU_SETSIZE) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(opts.cpu, &set);
+            if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) ++option_errors;
+        } else {
+            ++option_errors;
+        }
+    }
 }
 
-int MqttSocket::send(const protocol::Message &msg) {
-    // FIXME: Do proper error handling and handling of incomplete
-    // sends (bytes_send < msg.size())
-    size_t bytes_sent = ::send(sock, msg.data(), msg.length(), 0);
-    if(bytes_sent != msg.length()) {
+/**
+ * TCP_QUICKACK is not permanent, the kernel may fall back to delayed
+ * acks at any time, so it has to be set again after reading
+ */
+void MqttSocket::rearm_quickack() {
+    if(opts.tcp_quickack) {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+}
+
+int MqttSocket::wait_ready(int timeout_ms, bool writable, int wait_fd) {
+    struct pollfd pfd[2] {};
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN | (writable ? POLLOUT : 0);
+    pfd[1].fd = wait_fd;
+    pfd[1].events = POLLIN;
+    return poll(pfd, wait_fd >= 0 ? 2 : 1, timeout_ms);
+}
+
+void MqttSocket::close_socket() {
+    if(sock >= 0) {
+        ::close(sock);
+        sock = -1;
+    }
+    rxbuf.clear();
+    stream_remaining = 0;
+    stream_started = false;
+}
+
+int MqttSocket::send(const protocol::Message &msg, size_t offset, bool more) {
+    ssize_t bytes_sent = ::send(sock, msg.data() + offset, msg.length() - offset, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if(bytes_sent < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+    if(capture && offset == 0 && bytes_sent > 0) {
+        // recorded once, when the socket took its first bytes
+        record(CaptureDirection::outbound, msg.data(), msg.length());
+    }
+    return bytes_sent;
+}
+
+int MqttSocket::send_file(const FileBody &body, size_t offset) {
+    // sendfile and splice have no MSG_NOSIGNAL, so keep a SIGPIPE from a
+    // peer that went away pending instead of killing the process, and
+    // swallow it afterwards
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    size_t count = std::min<size_t>(body.length - offset, 1 << 30);
+    ssize_t bytes_sent;
+    if(body.pipe) {
+        bytes_sent = splice(body.fd, nullptr, sock, nullptr, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    } else {
+        off_t pos = body.offset + offset;
+        bytes_sent = sendfile(sock, body.fd, &pos, count);
+    }
+    int err = errno;
+
+    if(bytes_sent < 0 && err == EPIPE) {
+        struct timespec zero {};
+        sigtimedwait(&pipe_set, nullptr, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+
+    if(bytes_sent < 0) {
+        if(err == EAGAIN || err == EWOULDBLOCK) {
+            // splice doesn't tell an empty pipe from a full socket
+            struct pollfd pfd {};
+            pfd.fd = body.fd;
+            pfd.events = POLLIN;
+            if(body.pipe && poll(&pfd, 1, 0) == 0) {
+                return -3;
+            }
+            return 0;
+        }
         return -1;
     }
-    return 0;
-} 
+    if(bytes_sent == 0) {
+        // end of file or pipe before the body was complete, the frame
+        // can't be finished anymore
+        return -2;
+    }
+    return bytes_sent;
+}
 
 // this should be called cyclically from the global loop. It will do
 // all reception from a socket (or whatever), and will push new messages
 // received on the inbound message queue
 int MqttSocket::receive(std::deque<protocol::Message> &inqueue) {
-    // FIXME: Do proper error handling and handling of incomplete
-    // messages (kind of "suspend" reception of message, return
-    // 0, and resume/complete reception on the next call
-
-    std::vector<uint8_t> buf(5);
-    int result = recv(sock, buf.data(), buf.size(), 0);
-    if(result != -1) buf.resize(result);
-    if(!handle_recv_return(result)) return 0;
-
-    int missing = protocol::Message::get_missing_length(buf);
-    
-    if(missing > 0) {
-        buf.resize(result + missing);
-        result = recv(sock, buf.data()+5, buf.size()-5, 0);
-        if(result != -1) buf.resize(result);
-        if(!handle_recv_return(result)) return 0;
-    }
-            
-    protocol::Message msg(buf);
-
-    inqueue.push_back(msg);
-    return 1;
+    if(stream_remaining && !stream_started) {
+        // headers of a streamed publish are queued, wait for begin_stream()
+        return 0;
+    }
+
+    // read whatever is pending in one go, then cut complete frames off
+    // the front of the buffer. Incomplete frames stay in rxbuf until the
+    // next call. Streamed payloads are read in bigger pieces, they don't
+    // stay in the buffer.
+    int chunk = RX_CHUNK;
+    if(stream_remaining) chunk = STREAM_CHUNK;
+    size_t old = rxbuf.size();
+    rxbuf.resize(old + chunk);
+    int result = recv(sock, rxbuf.data() + old, chunk, 0);
+    rxbuf.resize(old + (result > 0 ? result : 0));
+    result = handle_recv_return(result);
+    if(result <= 0) return result;
+    rearm_quickack();
+
+    if(stream_remaining) {
+        return deliver(inqueue) < 0 ? -2 : 1;
+    }
+    int frames = deframe(inqueue);
+    if(frames < 0) return frames;
+    return (frames > 0 || result == chunk) ? 1 : 0;
+}
+
+int MqttSocket::inject(const uint8_t *data, size_t length, std::deque<protocol::Message> &inqueue) {
+    rxbuf.insert(rxbuf.end(), data, data + length);
+    if(stream_remaining) {
+        return stream_started ? deliver(inqueue) : 0;
+    }
+    return deframe(inqueue);
+}
+
+void MqttSocket::set_stream(size_t threshold, std::function<void(const uint8_t *, size_t)> sink) {
+    stream_threshold = threshold;
+    stream_sink = sink;
+}
+
+int MqttSocket::begin_stream(std::deque<protocol::Message> &inqueue) {
+    stream_started = true;
+    return deliver(inqueue);
+}
+
+/**
+ * hand the buffered part of a streamed payload to the sink, and go back
+ * to deframing once it is complete
+ */
+int MqttSocket::deliver(std::deque<protocol::Message> &inqueue) {
+    size_t n = std::min(rxbuf.size(), stream_remaining);
+    if(n) {
+        if(capture) {
+            // recorded as raw bytes behind the headers, replay feeds
+            // records back as a byte stream
+            record(CaptureDirection::inbound, rxbuf.data(), n);
+        }
+        stream_remaining -= n;
+        stream_sink(rxbuf.data(), n);
+        if(rxbuf.size() < n) {
+            return 0;   // the sink closed the socket
+        }
+        rxbuf.erase(rxbuf.begin(), rxbuf.begin() + n);
+    }
+    if(stream_remaining) {
+        return 0;
+    }
+    stream_started = false;
+    return deframe(inqueue);
+}
+
+/**
+ * cut all complete frames off the front of the receive buffer. Stops
+ * behind the headers of a streamed publish.
+ * @return number of frames, -2 if a remaining length is malformed. The
+ *          stream can't be resynced, the connection has to go.
+ */
+int MqttSocket::deframe(std::deque<protocol::Message> &inqueue) {
+    size_t pos = 0;
+    int frames = 0;
+    for(;;) {
+        const uint8_t *p = rxbuf.data() + pos;
+        size_t avail = rxbuf.size() - pos;
+        size_t remlength;
+        int header = protocol::Message::fixed_header(p, avail, remlength);
+        if(header < 0) {
+            rxbuf.clear();
+            return -2;
+        }
+        if(header == 0) break;
+
+        if(stream_threshold && remlength >= stream_threshold && (p[0] & 0xf0) == static_cast<uint8_t>(protocol::MsgType::publish)) {
+            if(avail < static_cast<size_t>(header) + 2) break;
+            size_t head = header + 2 + ((p[header] << 8) | p[header + 1]);
+            if(p[0] & 0x06) head += 2;  // packet identifier
+            if(head <= header + remlength) {
+                if(avail < head) break;
+                if(capture) {
+                    record(CaptureDirection::inbound, p, head);
+                }
+                inqueue.push_back(protocol::Message(std::vector<uint8_t>(p, p + head)));
+                stream_remaining = header + remlength - head;
+                stream_started = false;
+                pos += head;
+                ++frames;
+                if(stream_remaining) break;
+                continue;
+            }
+            // a topic longer than the frame, leave that to the publish handler
+        }
+
+        size_t len = header + remlength;
+        if(avail < len) break;
+        if(capture) {
+            record(CaptureDirection::inbound, p, len);
+        }
+        inqueue.push_back(protocol::Message(std::vector<uint8_t>(p, p + len)));
+        pos += len;
+        ++frames;
+    }
+    rxbuf.erase(rxbuf.begin(), rxbuf.begin() + pos);
+    return frames;
+}
+
+bool MqttSocket::start_capture(const std::string &path) {
+    std::unique_ptr<CaptureWriter> writer(new CaptureWriter());
+    if(!writer->open(path)) {
+        return false;
+    }
+    capture = std::move(writer);
+    return true;
+}
+
+void MqttSocket::stop_capture() {
+    capture.reset();
+}
+
+void MqttSocket::record(CaptureDirection dir, const uint8_t *data, size_t length) {
+    auto ts = std::chrono::steady_clock::now().time_since_epoch();
+    capture->record(dir, std::chrono::duration_cast<std::chrono::nanoseconds>(ts).count(), data, length);
 }
 
 }   // namespace detail
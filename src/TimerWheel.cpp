@@ -0,0 +1,214 @@
+/**
+ * Timer handling component for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TimerWheel.h"
+
+namespace mqpp {
+namespace detail {
+
+TimerWheel::TimerWheel(clock::time_point origin)
+    : free_head(NIL), current(0), count(0), origin(origin)
+{
+    for(unsigned i = 0; i < LEVELS * SLOTS; ++i) heads[i] = NIL;
+    for(unsigned l = 0; l < LEVELS; ++l) occupied[l] = 0;
+}
+
+TimerWheel::TimerId TimerWheel::arm(clock::time_point when, Callback cb) {
+    uint32_t index;
+    if(free_head != NIL) {
+        index = free_head;
+        free_head = nodes[index].next;
+    } else {
+        index = nodes.size();
+        nodes.push_back(Node());
+        nodes[index].generation = 0;
+    }
+
+    Node &n = nodes[index];
+    n.expires = to_tick(when, true);
+    n.cb = std::move(cb);
+    // the current tick is already processed, so anything due now fires
+    // on the next call to advance()
+    insert(index, current + 1);
+    ++count;
+
+    TimerId id;
+    id.index = index;
+    id.generation = n.generation;
+    return id;
+}
+
+bool TimerWheel::cancel(TimerId &id) {
+    if(!armed(id)) {
+        id = TimerId();
+        return false;
+    }
+    unlink(id.index);
+    release(id.index);
+    --count;
+    id = TimerId();
+    return true;
+}
+
+bool TimerWheel::armed(const TimerId &id) const {
+    return      id.index < nodes.size()
+            &&  nodes[id.index].generation == id.generation
+            &&  nodes[id.index].slot != FREE;
+}
+
+size_t TimerWheel::advance(clock::time_point now) {
+    uint64_t target = to_tick(now, false);
+    size_t fired = 0;
+
+    // jump straight to the next tick that has work to do instead of
+    // stepping through every millisecond
+    while(current < target) {
+        uint64_t next = next_tick();
+        if(next > target) {
+            current = target;
+            break;
+        }
+        current = next;
+        for(unsigned l = 1; l < LEVELS; ++l) {
+            if(current & ((uint64_t(1) << (l * SLOT_BITS)) - 1)) break;
+            cascade(l);
+        }
+        fired += expire();
+    }
+    return fired;
+}
+
+TimerWheel::clock::time_point TimerWheel::next_deadline() const {
+    if(count == 0) {
+        return clock::time_point::max();
+    }
+    return origin + std::chrono::milliseconds(next_tick());
+}
+
+uint64_t TimerWheel::to_tick(clock::time_point tp, bool round_up) const {
+    if(tp <= origin) return 0;
+    if(tp == clock::time_point::max()) return UINT64_MAX >> 1;
+    auto d = tp - origin;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(d);
+    uint64_t tick = ms.count();
+    if(round_up && ms < d) ++tick;
+    return tick;
+}
+
+/**
+ * lowest tick at which a slot holding timers gets processed, either
+ * expired (level 0) or cascaded (higher levels)
+ */
+uint64_t TimerWheel::next_tick() const {
+    uint64_t best = UINT64_MAX;
+    for(unsigned l = 0; l < LEVELS; ++l) {
+        if(!occupied[l]) continue;
+        unsigned shift = l * SLOT_BITS;
+        uint64_t base = (current >> shift) + 1;
+        unsigned start = base & (SLOTS - 1);
+        uint64_t rotated = (occupied[l] >> start) | (occupied[l] << ((SLOTS - start) & (SLOTS - 1)));
+        uint64_t tick = (base + __builtin_ctzll(rotated)) << shift;
+        if(tick < best) best = tick;
+    }
+    return best;
+}
+
+void TimerWheel::insert(uint32_t index, uint64_t earliest) {
+    Node &n = nodes[index];
+    uint64_t place = n.expires < earliest ? earliest : n.expires;
+    uint64_t delta = place - current;
+
+    unsigned level = 0;
+    while(level < LEVELS - 1 && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))) {
+        ++level;
+    }
+    if(delta >= (uint64_t(1) << (LEVELS * SLOT_BITS))) {
+        // beyond the horizon: park it in the farthest slot, it will be
+        // re-inserted with its real expiry when that slot is cascaded
+        place = current + (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+    }
+
+    unsigned idx = (place >> (level * SLOT_BITS)) & (SLOTS - 1);
+    uint16_t slot = level * SLOTS + idx;
+
+    n.slot = slot;
+    n.prev = NIL;
+    n.next = heads[slot];
+    if(n.next != NIL) nodes[n.next].prev = index;
+    heads[slot] = index;
+    occupied[level] |= uint64_t(1) << idx;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Node &n = nodes[index];
+    if(n.prev != NIL) {
+        nodes[n.prev].next = n.next;
+    } else {
+        heads[n.slot] = n.next;
+        if(n.next == NIL) {
+            occupied[n.slot / SLOTS] &= ~(uint64_t(1) << (n.slot % SLOTS));
+        }
+    }
+    if(n.next != NIL) nodes[n.next].prev = n.prev;
+    n.slot = FREE;
+}
+
+void TimerWheel::release(uint32_t index) {
+    Node &n = nodes[index];
+    n.slot = FREE;
+    ++n.generation;
+    n.cb = nullptr;
+    n.next = free_head;
+    free_head = index;
+}
+
+void TimerWheel::cascade(unsigned level) {
+    unsigned idx = (current >> (level * SLOT_BITS)) & (SLOTS - 1);
+    uint16_t slot = level * SLOTS + idx;
+    uint32_t index = heads[slot];
+    heads[slot] = NIL;
+    occupied[level] &= ~(uint64_t(1) << idx);
+
+    while(index != NIL) {
+        uint32_t next = nodes[index].next;
+        insert(index, current);
+        index = next;
+    }
+}
+
+size_t TimerWheel::expire() {
+    uint16_t slot = current & (SLOTS - 1);
+    size_t fired = 0;
+
+    // pop one node at a time, the callback may arm or cancel other timers
+    while(heads[slot] != NIL) {
+        uint32_t index = heads[slot];
+        unlink(index);
+        Callback cb;
+        std::swap(cb, nodes[index].cb);
+        release(index);
+        --count;
+        ++fired;
+        cb();
+    }
+    return fired;
+}
+
+}   // namespace detail
+}   // namespace mqpp
@@ -0,0 +1,213 @@
+/**
+ * String and topic validation for a native
+ * C++ mqtt client
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MQPP_X86 1
+#include <immintrin.h>
+#endif
+
+#include "Validation.h"
+
+namespace mqpp {
+namespace protocol {
+
+// Topics, client ids etc. are nearly always plain ascii, so the vector
+// code only answers "how long is the prefix that needs no further
+// checks": bytes 0x01-0x7f, minus + and # for topic names. Multi-byte
+// UTF-8 sequences are then checked by the scalar decoder, and scanning
+// resumes behind them.
+
+static size_t ascii_prefix_scalar(const char *s, size_t n, bool topic) {
+    for(size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if(c == 0 || c >= 0x80 || (topic && (c == '+' || c == '#'))) return i;
+    }
+    return n;
+}
+
+#ifdef MQPP_X86
+
+__attribute__((target("sse4.1")))
+static inline int special_mask_sse4(__m128i v, bool topic) {
+    // a byte is special if its high bit is set (non-ascii) or it is 0,
+    // the comparisons yield 0xff for matches, so the high bit is all we need
+    __m128i special = _mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    if(topic) {
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+    }
+    if(_mm_testz_si128(special, _mm_set1_epi8(static_cast<char>(0x80)))) {
+        return 0;
+    }
+    return _mm_movemask_epi8(special);
+}
+
+__attribute__((target("sse4.1")))
+static size_t ascii_prefix_sse4(const char *s, size_t n, bool topic) {
+    if(n < 16) {
+        return ascii_prefix_scalar(s, n, topic);
+    }
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        int mask = special_mask_sse4(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)), topic);
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    if(i < n) {
+        // overlapping load for the tail, the bytes before i are known good
+        int mask = special_mask_sse4(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + n - 16)), topic);
+        if(mask) return n - 16 + __builtin_ctz(mask);
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_avx2(const char *s, size_t n, bool topic) {
+    if(n < 32) {
+        return ascii_prefix_sse4(s, n, topic);
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i plus = _mm256_set1_epi8('+');
+    const __m256i hash = _mm256_set1_epi8('#');
+    size_t i = 0;
+    for(;;) {
+        size_t pos = i + 32 <= n ? i : n - 32;
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + pos));
+        __m256i special = _mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero));
+        if(topic) {
+            special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, plus));
+            special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, hash));
+        }
+        unsigned mask = _mm256_movemask_epi8(special);
+        if(mask) return pos + __builtin_ctz(mask);
+        i = pos + 32;
+        if(i >= n) return n;
+    }
+}
+
+#endif
+
+static SimdLevel detect() {
+#ifdef MQPP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return SimdLevel::avx2;
+    if(__builtin_cpu_supports("sse4.1")) return SimdLevel::sse4;
+#endif
+    return SimdLevel::scalar;
+}
+
+static const SimdLevel supported = detect();
+static SimdLevel active = supported;
+
+static size_t ascii_prefix(const char *s, size_t n, bool topic) {
+    switch(active) {
+#ifdef MQPP_X86
+        case SimdLevel::avx2:
+            return ascii_prefix_avx2(s, n, topic);
+        case SimdLevel::sse4:
+            return ascii_prefix_sse4(s, n, topic);
+#endif
+        default:
+            return ascii_prefix_scalar(s, n, topic);
+    }
+}
+
+SimdLevel simd_level() {
+    return active;
+}
+
+void set_simd_level(SimdLevel level) {
+    active = static_cast<int>(level) > static_cast<int>(supported) ? supported : level;
+}
+
+/**
+ * length of the well-formed UTF-8 multi-byte sequence at p, 0 if it is
+ * malformed, overlong, a surrogate or beyond U+10FFFF (RFC 3629)
+ */
+static size_t utf8_sequence(const unsigned char *p, size_t n) {
+    unsigned char c = p[0];
+    unsigned char lo = 0x80, hi = 0xbf;   // allowed range of the second byte
+    size_t len;
+    if(c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+    } else if(c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        if(c == 0xe0) lo = 0xa0;
+        if(c == 0xed) hi = 0x9f;
+    } else if(c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        if(c == 0xf0) lo = 0x90;
+        if(c == 0xf4) hi = 0x8f;
+    } else {
+        return 0;
+    }
+    if(n < len || p[1] < lo || p[1] > hi) {
+        return 0;
+    }
+    for(size_t k = 2; k < len; ++k) {
+        if((p[k] & 0xc0) != 0x80) return 0;
+    }
+    return len;
+}
+
+static bool valid_chars(const char *s, size_t n, bool topic) {
+    if(n > 65535) {
+        return false;
+    }
+    size_t i = 0;
+    for(;;) {
+        i += ascii_prefix(s + i, n - i, topic);
+        if(i == n) {
+            return true;
+        }
+        if(static_cast<unsigned char>(s[i]) < 0x80) {
+            return false;   // U+0000 or a wildcard
+        }
+        size_t len = utf8_sequence(reinterpret_cast<const unsigned char *>(s + i), n - i);
+        if(!len) {
+            return false;
+        }
+        i += len;
+    }
+}
+
+bool valid_string(const char *s, size_t length) {
+    return valid_chars(s, length, false);
+}
+
+bool valid_topic_name(const char *s, size_t length) {
+    return length > 0 && valid_chars(s, length, true);
+}
+
+bool valid_topic_filter(const std::string &s) {
+    if(s.empty() || !valid_string(s)) {
+        return false;
+    }
+    size_t n = s.size();
+    for(size_t i = ascii_prefix(s.data(), n, true); i < n; i += 1 + ascii_prefix(s.data() + i + 1, n - i - 1, true)) {
+        if(s[i] == '+') {
+            if((i > 0 && s[i - 1] != '/') || (i + 1 < n && s[i + 1] != '/')) return false;
+        } else if(s[i] == '#') {
+            if((i > 0 && s[i - 1] != '/') || i + 1 != n) return false;
+        }
+    }
+    return true;
+}
+
+}   // namespace protocol
+}   // namespace mqpp
@@ -30,16 +30,101 @@ mqtt_client::~mqtt_client() {
 void mqtt_client::connect(  const std::string &host, 
                             const int port, 
                             const std::chrono::duration<int> keepalive, 
-                            const std::string &bind_ip) {
-    impl->connect(host, port, keepalive, bind_ip);
+                            const std::string &bind_ip,
+                            const SocketOpts &sock_opts) {
+    impl->connect(host, port, keepalive, bind_ip, sock_opts);
 }
 
 void mqtt_client::publish(  std::string topic, 
                             std::string payload, 
                             QoS qos, 
-                            Retain retain) 
+                            Retain retain,
+                            Lane lane) 
 {
-    impl->publish(topic, payload, qos, retain);
+    impl->publish(topic, payload, qos, retain, lane);
+}
+
+void mqtt_client::publish_file(  std::string topic,
+                                int fd,
+                                uint64_t offset,
+                                size_t length,
+                                QoS qos,
+                                Retain retain,
+                                Lane lane)
+{
+    impl->publish_file(topic, fd, offset, length, qos, retain, lane);
+}
+
+void mqtt_client::set_stream_callback(const std::function<void(const std::string &, const uint8_t *, size_t, size_t, size_t)> &cb, size_t min_length) {
+    impl->set_stream_callback(cb, min_length);
+}
+
+size_t mqtt_client::outqueue_depth(Lane lane) const {
+    return impl->outqueue_depth(lane);
+}
+
+void mqtt_client::set_reconnect_opts(int first_delay_s, int max_delay_s, bool exponential_delay) {
+    impl->set_reconnect_opts(first_delay_s, max_delay_s, exponential_delay);
+}
+
+void mqtt_client::set_qos_opts(int retry_s, int max_inflight_messages) {
+    impl->set_qos_opts(retry_s, max_inflight_messages);
+}
+
+void mqtt_client::set_conflation_opts(bool conflate_all) {
+    impl->set_conflation_opts(conflate_all);
+}
+
+void mqtt_client::add_conflation_filter(const std::string &filter) {
+    impl->add_conflation_filter(filter);
+}
+
+void mqtt_client::set_last_value_cache_opts(size_t max_topics) {
+    impl->set_last_value_cache_opts(max_topics);
+}
+
+void mqtt_client::add_last_value_filter(const std::string &filter) {
+    impl->add_last_value_filter(filter);
+}
+
+uint64_t mqtt_client::last_value(const std::string &topic, std::string &payload) const {
+    return impl->last_value(topic, payload);
+}
+
+uint64_t mqtt_client::last_value_version(const std::string &topic) const {
+    return impl->last_value_version(topic);
+}
+
+void mqtt_client::start_capture(const std::string &path) {
+    impl->start_capture(path);
+}
+
+void mqtt_client::stop_capture() {
+    impl->stop_capture();
+}
+
+int mqtt_client::replay(const std::string &path, bool realtime) {
+    return impl->replay(path, realtime);
+}
+
+void mqtt_client::subscribe(const std::vector<std::pair<std::string, QoS>> &filters) {
+    impl->subscribe(filters);
+}
+
+void mqtt_client::unsubscribe(const std::vector<std::string> &filters) {
+    impl->unsubscribe(filters);
+}
+
+void mqtt_client::set_subscribe_opts(size_t max_packet_size) {
+    impl->set_subscribe_opts(max_packet_size);
+}
+
+void mqtt_client::set_subscribe_callback(const std::function<void(const std::vector<std::string> &, const std::vector<SubscribeResult> &)> &cb) {
+    impl->set_subscribe_callback(cb);
+}
+
+void mqtt_client::set_unsubscribe_callback(const std::function<void(const std::vector<std::string> &)> &cb) {
+    impl->set_unsubscribe_callback(cb);
 }
 
 void mqtt_client::set_logging_callback(  const std::function<void(LogLevel, std::string)> &cb, 
@@ -52,9 +137,14 @@ void mqtt_client::set_connect_status_callback(const std::function<void(Connectio
     impl->set_connect_status_callback(cb);
 }
 
-int mqtt_client::loop() 
+int mqtt_client::loop(std::chrono::milliseconds max_wait) 
+{
+    return impl->loop(max_wait);
+}
+
+std::chrono::steady_clock::time_point mqtt_client::next_deadline()
 {
-    return impl->loop();
+    return impl->next_deadline();
 }
 
 }   // namespace mqpp
@@ -0,0 +1,162 @@
+/**
+ * Tests for capture files, no broker needed
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Capture.h"
+
+using namespace mqpp::detail;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++failures; \
+        } \
+    } while(0)
+
+struct Frame {
+    uint64_t timestamp_ns;
+    CaptureDirection dir;
+    std::vector<uint8_t> data;
+};
+
+/** frame i of the test capture, lengths vary so records straddle buffers */
+static Frame frame(size_t i) {
+    Frame f;
+    f.timestamp_ns = 1000 * i + 7;
+    f.dir = i % 3 ? CaptureDirection::inbound : CaptureDirection::outbound;
+    size_t length = 1 + (i * 7919) % 9000;
+    if(i == 100) {
+        length = 3 << 20;   // bigger than a whole buffer
+    }
+    f.data.resize(length);
+    for(size_t k = 0; k < length; ++k) {
+        f.data[k] = static_cast<uint8_t>(i * 31 + k);
+    }
+    return f;
+}
+
+static std::string temp_path() {
+    char path[] = "/tmp/mqpp_test_capture_XXXXXX";
+    int fd = mkstemp(path);
+    if(fd >= 0) {
+        close(fd);
+    }
+    return path;
+}
+
+/** @return number of records that read back as written */
+static size_t read_back(const std::string &path, size_t expected) {
+    CaptureReader reader;
+    CHECK(reader.open(path));
+    CaptureReader::Record rec;
+    size_t n = 0;
+    while(reader.next(rec)) {
+        Frame f = frame(n);
+        bool same = rec.timestamp_ns == f.timestamp_ns
+                && rec.dir == f.dir
+                && rec.length == f.data.size()
+                && std::memcmp(rec.data, f.data.data(), f.data.size()) == 0;
+        CHECK(same);
+        if(!same) break;
+        ++n;
+    }
+    CHECK(n <= expected);
+    return n;
+}
+
+static void test_round_trip() {
+    // well over the whole buffer pool, so buffers are reused
+    const size_t frames = 2000;
+    std::string path = temp_path();
+    size_t bytes = 0;
+    {
+        CaptureWriter writer;
+        CHECK(writer.open(path));
+        for(size_t i = 0; i < frames; ++i) {
+            Frame f = frame(i);
+            writer.record(f.dir, f.timestamp_ns, f.data.data(), f.data.size());
+            bytes += f.data.size();
+        }
+        writer.close();
+    }
+    CHECK(bytes > (8u << 20));
+    CHECK(read_back(path, frames) == frames);
+
+    // a capture cut off inside a record ends with the last complete one
+    CHECK(truncate(path.c_str(), 8 + (8 + 4 + 1) * 3 + frame(0).data.size() + frame(1).data.size() + frame(2).data.size() - 1) == 0);
+    CHECK(read_back(path, frames) == 2);
+    unlink(path.c_str());
+}
+
+static void test_reopen() {
+    // the writer is reusable, a new file starts from scratch
+    std::string first = temp_path();
+    std::string second = temp_path();
+    CaptureWriter writer;
+    CHECK(writer.open(first));
+    for(size_t i = 0; i < 10; ++i) {
+        Frame f = frame(i);
+        writer.record(f.dir, f.timestamp_ns, f.data.data(), f.data.size());
+    }
+    CHECK(writer.open(second));
+    for(size_t i = 0; i < 5; ++i) {
+        Frame f = frame(i);
+        writer.record(f.dir, f.timestamp_ns, f.data.data(), f.data.size());
+    }
+    writer.close();
+    CHECK(read_back(first, 10) == 10);
+    CHECK(read_back(second, 5) == 5);
+    unlink(first.c_str());
+    unlink(second.c_str());
+}
+
+static void test_not_a_capture() {
+    std::string path = temp_path();
+    CaptureReader empty;
+    CHECK(!empty.open(path));
+    FILE *f = fopen(path.c_str(), "w");
+    fputs("definitely not a capture file", f);
+    fclose(f);
+    CaptureReader other;
+    CHECK(!other.open(path));
+    unlink(path.c_str());
+    CaptureReader missing;
+    CHECK(!missing.open(path));
+}
+
+int main() {
+    test_round_trip();
+    test_reopen();
+    test_not_a_capture();
+    if(failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "capture tests passed" << std::endl;
+    return 0;
+}
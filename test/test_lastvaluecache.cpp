@@ -0,0 +1,158 @@
+/**
+ * Tests for the last value cache, no broker needed
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "LastValueCache.h"
+
+using namespace mqpp::detail;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++failures; \
+        } \
+    } while(0)
+
+static bool update(LastValueCache &cache, const std::string &topic, const std::string &payload) {
+    return cache.update(topic, reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+}
+
+static void test_update_read() {
+    LastValueCache cache(16);
+    std::string payload = "untouched";
+    CHECK(cache.read("a/b", payload) == 0);
+    CHECK(cache.version("a/b") == 0);
+
+    CHECK(update(cache, "a/b", "one"));
+    CHECK(cache.version("a/b") == 1);
+    CHECK(cache.read("a/b", payload) == 1);
+    CHECK(payload == "one");
+
+    // growing past the buffer, shrinking and empty payloads
+    std::string big(1000, 'x');
+    CHECK(update(cache, "a/b", big));
+    CHECK(cache.read("a/b", payload) == 2);
+    CHECK(payload == big);
+    CHECK(update(cache, "a/b", "two"));
+    CHECK(cache.read("a/b", payload) == 3);
+    CHECK(payload == "two");
+    CHECK(update(cache, "a/b", ""));
+    CHECK(cache.read("a/b", payload) == 4);
+    CHECK(payload.empty());
+
+    // topics are independent
+    CHECK(update(cache, "a/c", "other"));
+    CHECK(cache.read("a/c", payload) == 1);
+    CHECK(payload == "other");
+    CHECK(cache.version("a/b") == 4);
+    CHECK(cache.version("a") == 0);
+}
+
+static void test_filters() {
+    LastValueCache cache(16);
+    CHECK(!cache.matches("sensors/1/temp"));
+    cache.add_filter("sensors/+/temp");
+    cache.add_filter("status/#");
+    CHECK(cache.matches("sensors/1/temp"));
+    CHECK(!cache.matches("sensors/1/humidity"));
+    CHECK(cache.matches("status/gw/7"));
+}
+
+static void test_full() {
+    // the table holds at least max_topics, then refuses new topics
+    LastValueCache cache(4);
+    size_t stored = 0;
+    while(update(cache, "t/" + std::to_string(stored), "v")) {
+        ++stored;
+        if(stored > 64) break;
+    }
+    CHECK(stored >= 4);
+    CHECK(stored <= 64);
+    // known topics can still be updated
+    CHECK(update(cache, "t/0", "w"));
+    std::string payload;
+    CHECK(cache.read("t/0", payload) == 2);
+    CHECK(payload == "w");
+    CHECK(cache.read("t/" + std::to_string(stored), payload) == 0);
+}
+
+/** the payload written as version v, its length crosses buffer sizes */
+static std::string expected(uint64_t v) {
+    return std::string(1 + v % 700, static_cast<char>('a' + v % 26));
+}
+
+static void test_concurrent_reader() {
+    // a reader must only ever see complete values, with the version
+    // they were written as, and versions must not go backwards
+    LastValueCache cache(16);
+    const uint64_t updates = 200000;
+    std::atomic<bool> done(false);
+    uint64_t reads = 0;
+    uint64_t torn = 0;
+    uint64_t backwards = 0;
+
+    std::thread reader([&]() {
+        std::string payload;
+        uint64_t last = 0;
+        while(!done.load(std::memory_order_acquire)) {
+            uint64_t v = cache.read("hot", payload);
+            if(!v) continue;
+            ++reads;
+            if(payload != expected(v)) ++torn;
+            if(v < last) ++backwards;
+            last = v;
+        }
+    });
+
+    for(uint64_t v = 1; v <= updates; ++v) {
+        update(cache, "hot", expected(v));
+        if(v % 1000 == 0) {
+            // let the reader in, also on a single cpu
+            std::this_thread::yield();
+        }
+    }
+    done.store(true, std::memory_order_release);
+    reader.join();
+
+    CHECK(reads > 0);
+    CHECK(torn == 0);
+    CHECK(backwards == 0);
+    std::string payload;
+    CHECK(cache.read("hot", payload) == updates);
+    CHECK(payload == expected(updates));
+}
+
+int main() {
+    test_update_read();
+    test_filters();
+    test_full();
+    test_concurrent_reader();
+    if(failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "last value cache tests passed" << std::endl;
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <thread>
 #include <chrono>
 #include <iostream>
+#include <string>
 
 #include "mqpp.h"
 
@@ -29,16 +30,22 @@ int main(int argc, char *argv[]) {
     mqpp::mqtt_client instance;
     instance.set_logging_callback(logging_callback);
     instance.set_connect_status_callback(connect_status_callback);
-    instance.connect();
-    int count = 0;
-    while(!instance.loop()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-        if(count == 30) {
+    mqpp::SocketOpts opts;
+    for(int i = 1; i < argc; ++i) {
+        if(std::string(argv[i]) == "--low-latency") {
+            opts = mqpp::SocketOpts::low_latency();
+        } else if(std::string(argv[i]) == "--capture" && i + 1 < argc) {
+            instance.start_capture(argv[++i]);
+        }
+    }
+    instance.connect("localhost", 1883, std::chrono::seconds(20), "", opts);
+    auto publish_at = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+    bool published = false;
+    while(!instance.loop(std::chrono::milliseconds(100))) {
+        if(!published && std::chrono::steady_clock::now() >= publish_at) {
             instance.publish("foo/bar", "Teststring");
+            published = true;
         }
-
-        ++count;
     } 
 }
 
@@ -0,0 +1,325 @@
+/**
+ * Tests for subscribe / unsubscribe requests, no broker needed: the
+ * test plays the broker on a loopback socket
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mqpp.h"
+
+using namespace mqpp;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++failures; \
+        } \
+    } while(0)
+
+/** one packet as the broker sees it */
+struct Packet {
+    uint8_t type = 0;       // upper nibble of the first byte
+    size_t length = 0;      // whole frame
+    size_t remlength = 0;
+    uint16_t packet_id = 0;
+    std::vector<std::string> filters;
+};
+
+/**
+ * the broker side of one client. The client is single threaded, so
+ * every wait pumps its loop.
+ */
+class FakeBroker {
+public:
+    FakeBroker(mqtt_client &client) : client(client) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        listen(listener, 4);
+        socklen_t len = sizeof(addr);
+        getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+        port = ntohs(addr.sin_port);
+    }
+
+    ~FakeBroker() {
+        drop();
+        close(listener);
+    }
+
+    /** accept the next connection and answer its CONNECT */
+    bool accept_client() {
+        drop();
+        if(!wait_for(listener)) {
+            return false;
+        }
+        conn = accept(listener, nullptr, nullptr);
+        int one = 1;
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Packet connect;
+        if(!read(connect) || connect.type != 0x10) {
+            return false;
+        }
+        return write({ 0x20, 0x02, 0x00, 0x00 });
+    }
+
+    void drop() {
+        if(conn >= 0) {
+            close(conn);
+            conn = -1;
+        }
+        rxbuf.clear();
+    }
+
+    /** @return false if no complete packet came within a second */
+    bool read(Packet &pkt) {
+        for(;;) {
+            size_t remlength = 0;
+            size_t header = 0;
+            for(size_t pos = 1; pos < 5 && pos < rxbuf.size(); ++pos) {
+                remlength += static_cast<size_t>(rxbuf[pos] & 127) << ((pos - 1) * 7);
+                if(!(rxbuf[pos] & 128)) {
+                    header = pos + 1;
+                    break;
+                }
+            }
+            if(header && rxbuf.size() >= header + remlength) {
+                parse(pkt, header, remlength);
+                rxbuf.erase(rxbuf.begin(), rxbuf.begin() + header + remlength);
+                return true;
+            }
+            if(!wait_for(conn)) {
+                return false;
+            }
+            uint8_t buf[65536];
+            ssize_t n = recv(conn, buf, sizeof(buf), 0);
+            if(n <= 0) {
+                return false;
+            }
+            rxbuf.insert(rxbuf.end(), buf, buf + n);
+        }
+    }
+
+    bool write(const std::vector<uint8_t> &data) {
+        return send(conn, data.data(), data.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(data.size());
+    }
+
+    /** answer a SUBSCRIBE or UNSUBSCRIBE, granting the requested qos */
+    bool ack(const Packet &pkt, uint8_t qos = 1) {
+        uint8_t id_hi = pkt.packet_id >> 8;
+        uint8_t id_lo = pkt.packet_id & 0xff;
+        if(pkt.type == 0xa0) {
+            return write({ 0xb0, 0x02, id_hi, id_lo });
+        }
+        std::vector<uint8_t> suback { 0x90 };
+        size_t remlength = 2 + pkt.filters.size();
+        do {
+            suback.push_back((remlength & 127) | (remlength > 127 ? 128 : 0));
+            remlength >>= 7;
+        } while(remlength);
+        suback.push_back(id_hi);
+        suback.push_back(id_lo);
+        suback.insert(suback.end(), pkt.filters.size(), qos);
+        return write(suback);
+    }
+
+    /** let the client run for a while, e.g. to process acks */
+    void pump(int ms) {
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+        while(std::chrono::steady_clock::now() < end) {
+            client.loop(std::chrono::milliseconds(1));
+        }
+    }
+
+    int port;
+
+private:
+    bool wait_for(int fd) {
+        auto end = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while(std::chrono::steady_clock::now() < end) {
+            struct pollfd pfd {};
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if(poll(&pfd, 1, 0) > 0) {
+                return true;
+            }
+            client.loop(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    void parse(Packet &pkt, size_t header, size_t remlength) {
+        const uint8_t *p = rxbuf.data() + header;
+        const uint8_t *end = p + remlength;
+        pkt = Packet();
+        pkt.type = rxbuf[0] & 0xf0;
+        pkt.length = header + remlength;
+        pkt.remlength = remlength;
+        if(pkt.type != 0x80 && pkt.type != 0xa0) {
+            return;
+        }
+        pkt.packet_id = (p[0] << 8) | p[1];
+        p += 2;
+        while(p + 2 <= end) {
+            size_t len = (p[0] << 8) | p[1];
+            pkt.filters.push_back(std::string(reinterpret_cast<const char *>(p + 2), len));
+            p += 2 + len + (pkt.type == 0x80 ? 1 : 0);
+        }
+    }
+
+    mqtt_client &client;
+    int listener;
+    int conn = -1;
+    std::vector<uint8_t> rxbuf;
+};
+
+/**
+ * an unsubscribe made while disconnected, for a filter whose subscribe
+ * is still pending, has to reach the broker after the re-sent subscribe
+ */
+static void test_unsubscribe_while_disconnected() {
+    mqtt_client client;
+    FakeBroker broker(client);
+    int subscribed = 0;
+    int unsubscribed = 0;
+    client.set_subscribe_callback([&](const std::vector<std::string> &, const std::vector<SubscribeResult> &) { ++subscribed; });
+    client.set_unsubscribe_callback([&](const std::vector<std::string> &) { ++unsubscribed; });
+    client.set_reconnect_opts(0, 0, false);
+    client.connect("127.0.0.1", broker.port);
+    CHECK(broker.accept_client());
+    broker.pump(10);
+
+    client.subscribe({ { "a/b", QoS::at_least_once } });
+    Packet pkt;
+    CHECK(broker.read(pkt) && pkt.type == 0x80);
+    CHECK(pkt.filters == std::vector<std::string>{ "a/b" });
+
+    // the link goes down before SUBACK
+    broker.drop();
+    broker.pump(20);
+    client.unsubscribe({ "a/b" });
+    CHECK(unsubscribed == 0);
+
+    CHECK(broker.accept_client());
+    Packet sub, unsub;
+    CHECK(broker.read(sub) && sub.type == 0x80);
+    CHECK(sub.filters == std::vector<std::string>{ "a/b" });
+    CHECK(broker.read(unsub) && unsub.type == 0xa0);
+    CHECK(unsub.filters == std::vector<std::string>{ "a/b" });
+    CHECK(broker.ack(sub));
+    broker.pump(10);
+    CHECK(subscribed == 1);
+    CHECK(unsubscribed == 0);
+    CHECK(broker.ack(unsub));
+    broker.pump(10);
+    CHECK(unsubscribed == 1);
+
+    // nothing is left to restore on the next connection
+    CHECK(broker.accept_client());
+    CHECK(!broker.read(pkt));
+}
+
+/**
+ * a batch is packed into as few packets as the maximum packet size
+ * allows, in order, and a filter too big for any packet gets its own
+ */
+static void test_packing() {
+    const size_t max_packet_size = 100;
+    mqtt_client client;
+    FakeBroker broker(client);
+    std::vector<std::vector<std::string>> completed;
+    std::vector<SubscribeResult> results;
+    client.set_subscribe_callback([&](const std::vector<std::string> &filters, const std::vector<SubscribeResult> &r) {
+        completed.push_back(filters);
+        results = r;
+    });
+    client.set_subscribe_opts(max_packet_size);
+    client.connect("127.0.0.1", broker.port);
+    CHECK(broker.accept_client());
+    broker.pump(10);
+
+    std::vector<std::pair<std::string, QoS>> batch;
+    std::vector<std::string> filters;
+    for(size_t i = 0; i < 40; ++i) {
+        std::string filter = "gw/" + std::to_string(i) + "/" + std::string(i % 17, 'x');
+        if(i == 13) {
+            filter = "big/" + std::string(200, 'y');
+        }
+        batch.push_back({ filter, QoS::at_least_once });
+        filters.push_back(filter);
+    }
+    client.subscribe(batch);
+
+    std::vector<Packet> packets;
+    std::vector<std::string> sent;
+    while(sent.size() < filters.size()) {
+        Packet pkt;
+        if(!broker.read(pkt)) break;
+        CHECK(pkt.type == 0x80);
+        CHECK(!pkt.filters.empty());
+        sent.insert(sent.end(), pkt.filters.begin(), pkt.filters.end());
+        packets.push_back(pkt);
+    }
+    CHECK(sent == filters);
+    CHECK(packets.size() > 3);
+
+    bool oversized = false;
+    for(size_t i = 0; i < packets.size(); ++i) {
+        const Packet &pkt = packets[i];
+        if(pkt.length > max_packet_size) {
+            CHECK(pkt.filters == std::vector<std::string>{ filters[13] });
+            oversized = true;
+        } else {
+            CHECK(pkt.length <= max_packet_size);
+        }
+        // no packet was closed while the next filter still fit
+        if(i + 1 < packets.size()) {
+            size_t next = 2 + packets[i + 1].filters[0].size() + 1;
+            CHECK(5 + pkt.remlength + next > max_packet_size);
+        }
+        CHECK(broker.ack(pkt));
+    }
+    CHECK(oversized);
+    broker.pump(20);
+    CHECK(completed.size() == 1 && completed[0] == filters);
+    CHECK(results == std::vector<SubscribeResult>(filters.size(), SubscribeResult::granted_at_least_once));
+}
+
+int main() {
+    test_unsubscribe_while_disconnected();
+    test_packing();
+    if(failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "subscribe tests passed" << std::endl;
+    return 0;
+}
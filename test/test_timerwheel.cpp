@@ -0,0 +1,198 @@
+/**
+ * Tests for the timer wheel, no broker needed
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "TimerWheel.h"
+
+using namespace mqpp::detail;
+using std::chrono::milliseconds;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++failures; \
+        } \
+    } while(0)
+
+static const TimerWheel::clock::time_point origin;
+
+static TimerWheel::clock::time_point at(long ms) {
+    return origin + milliseconds(ms);
+}
+
+static void test_arm_fire() {
+    TimerWheel wheel(origin);
+    int fired = 0;
+    TimerWheel::TimerId id = wheel.arm(at(5), [&]() { ++fired; });
+    CHECK(wheel.armed(id));
+    CHECK(wheel.size() == 1);
+    CHECK(wheel.advance(at(4)) == 0);
+    CHECK(fired == 0);
+    CHECK(wheel.advance(at(5)) == 1);
+    CHECK(fired == 1);
+    CHECK(!wheel.armed(id));
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.advance(at(100)) == 0);
+    CHECK(fired == 1);
+}
+
+static void test_cancel() {
+    TimerWheel wheel(origin);
+    int fired = 0;
+    TimerWheel::TimerId id = wheel.arm(at(10), [&]() { ++fired; });
+    CHECK(wheel.cancel(id));
+    CHECK(!wheel.armed(id));
+    CHECK(!wheel.cancel(id));
+    wheel.advance(at(20));
+    CHECK(fired == 0);
+
+    // a stale handle must not cancel the timer that reuses its node
+    TimerWheel::TimerId first = wheel.arm(at(30), [&]() { ++fired; });
+    TimerWheel::TimerId stale = first;
+    wheel.advance(at(30));
+    CHECK(fired == 1);
+    TimerWheel::TimerId second = wheel.arm(at(40), [&]() { ++fired; });
+    CHECK(!wheel.cancel(stale));
+    CHECK(wheel.armed(second));
+    wheel.advance(at(40));
+    CHECK(fired == 2);
+}
+
+static void test_cascade() {
+    // one timer per level and beyond the range of the wheel
+    const long due[] = { 3, 63, 64, 100, 4095, 4096, 5000, 262143, 262144, 300000, 16777216, 20000000 };
+    for(long ms : due) {
+        TimerWheel wheel(origin);
+        int fired = 0;
+        wheel.arm(at(ms), [&]() { ++fired; });
+        wheel.advance(at(ms / 2));
+        wheel.advance(at(ms - 1));
+        CHECK(fired == 0);
+        wheel.advance(at(ms));
+        if(fired != 1) {
+            std::cerr << "timer at " << ms << "ms didn't fire on time" << std::endl;
+        }
+        CHECK(fired == 1);
+    }
+}
+
+static void test_next_deadline() {
+    TimerWheel wheel(origin);
+    CHECK(wheel.next_deadline() == TimerWheel::clock::time_point::max());
+
+    TimerWheel::TimerId near = wheel.arm(at(10), []() {});
+    CHECK(wheel.next_deadline() == at(10));
+
+    // further out it is a lower bound, but never later than the timer
+    wheel.cancel(near);
+    wheel.arm(at(100000), []() {});
+    CHECK(wheel.next_deadline() > at(0));
+    CHECK(wheel.next_deadline() <= at(100000));
+
+    // following next_deadline() must reach the timer
+    int steps = 0;
+    while(wheel.size() && steps < 100) {
+        wheel.advance(wheel.next_deadline());
+        ++steps;
+    }
+    CHECK(wheel.size() == 0);
+}
+
+static void test_rearm_from_callback() {
+    TimerWheel wheel(origin);
+    int fired = 0;
+    std::function<void()> tick;
+    tick = [&]() {
+        if(++fired < 5) wheel.arm(at(fired * 10 + 10), tick);
+    };
+    wheel.arm(at(10), tick);
+    wheel.advance(at(1000));
+    CHECK(fired == 5);
+}
+
+/** random timers and cancellations, checked against the expected firing time */
+static void test_random() {
+    std::mt19937 rng(42);
+    TimerWheel wheel(origin);
+    struct Expect {
+        long due;
+        long fired;
+        bool cancelled;
+        size_t armed_after;     // number of advance() calls before arm()
+        TimerWheel::TimerId id;
+    };
+    std::vector<Expect> timers(5000);
+    std::vector<long> advances;
+    long now = 0;
+    for(size_t i = 0; i < timers.size(); ++i) {
+        long range = (rng() % 4 == 0) ? 20000000 : 5000;
+        timers[i].due = now + rng() % range;
+        timers[i].fired = -1;
+        timers[i].cancelled = false;
+        timers[i].armed_after = advances.size();
+        timers[i].id = wheel.arm(at(timers[i].due), [&timers, i, &now]() { timers[i].fired = now; });
+        if(rng() % 8 == 0) {
+            size_t victim = rng() % (i + 1);
+            if(timers[victim].fired < 0 && !timers[victim].cancelled) {
+                CHECK(wheel.cancel(timers[victim].id));
+                timers[victim].cancelled = true;
+            }
+        }
+        if(rng() % 4 == 0) {
+            now += rng() % 3000;
+            advances.push_back(now);
+            wheel.advance(at(now));
+        }
+    }
+    while(wheel.size()) {
+        auto next = wheel.next_deadline();
+        now = std::chrono::duration_cast<milliseconds>(next - origin).count();
+        advances.push_back(now);
+        wheel.advance(next);
+    }
+    for(const Expect &e : timers) {
+        if(e.cancelled) {
+            CHECK(e.fired < 0);
+        } else {
+            // fired in the first later advance() that reached the due time
+            CHECK(e.fired == *std::lower_bound(advances.begin() + e.armed_after, advances.end(), e.due));
+        }
+    }
+}
+
+int main() {
+    test_arm_fire();
+    test_cancel();
+    test_cascade();
+    test_next_deadline();
+    test_rearm_from_callback();
+    test_random();
+    if(failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "timer wheel tests passed" << std::endl;
+    return 0;
+}
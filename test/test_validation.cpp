@@ -0,0 +1,155 @@
+/**
+ * Tests for string, topic and filter validation and topic matching,
+ * no broker needed
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <string>
+
+#include "mqtt_311.h"
+#include "Validation.h"
+
+using namespace mqpp::protocol;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++failures; \
+        } \
+    } while(0)
+
+static std::string str(const char *s, size_t n) {
+    return std::string(s, n);
+}
+
+static void test_strings() {
+    CHECK(valid_string(""));
+    CHECK(valid_string("plain ascii"));
+    CHECK(valid_string("gr\xc3\xbc\xc3\x9f" "e"));             // 2 byte sequences
+    CHECK(valid_string("\xe2\x82\xac"));                        // U+20AC
+    CHECK(valid_string("\xf0\x9f\x98\x80"));                    // U+1F600
+    CHECK(valid_string("\xf4\x8f\xbf\xbf"));                    // U+10FFFF
+    CHECK(!valid_string(str("a\0b", 3)));                      // U+0000
+    CHECK(!valid_string("\x80"));                               // stray continuation
+    CHECK(!valid_string("\xc3"));                               // truncated
+    CHECK(!valid_string("\xc0\xaf"));                           // overlong
+    CHECK(!valid_string("\xe0\x80\xaf"));                       // overlong
+    CHECK(!valid_string("\xed\xa0\x80"));                       // surrogate
+    CHECK(!valid_string("\xf4\x90\x80\x80"));                   // beyond U+10FFFF
+    CHECK(!valid_string("\xff"));
+    CHECK(valid_string(std::string(65535, 'a')));
+    CHECK(!valid_string(std::string(65536, 'a')));
+}
+
+static void test_topic_names() {
+    CHECK(valid_topic_name("a"));
+    CHECK(valid_topic_name("sport/tennis/player1"));
+    CHECK(valid_topic_name("/"));
+    CHECK(valid_topic_name("$SYS/broker"));
+    CHECK(!valid_topic_name(""));
+    CHECK(!valid_topic_name("sport/+/player1"));
+    CHECK(!valid_topic_name("sport/#"));
+    CHECK(!valid_topic_name("a+b"));
+    CHECK(!valid_topic_name(str("a\0", 2)));
+
+    // special bytes at every position of strings long enough for the
+    // vector code, including the overlapping tail load
+    for(size_t len : { 15, 16, 17, 31, 32, 33, 47, 64, 100 }) {
+        std::string base(len, 'x');
+        CHECK(valid_topic_name(base));
+        for(size_t i = 0; i < len; ++i) {
+            std::string s = base;
+            s[i] = '+';
+            CHECK(!valid_topic_name(s));
+            s[i] = '#';
+            CHECK(!valid_topic_name(s));
+            s[i] = '\0';
+            CHECK(!valid_topic_name(s));
+            s[i] = '\x80';
+            CHECK(!valid_topic_name(s));
+            if(i + 2 <= len) {
+                s[i] = '\xc3';
+                s[i + 1] = '\xa4';
+                CHECK(valid_topic_name(s));
+            }
+        }
+    }
+}
+
+static void test_topic_filters() {
+    CHECK(valid_topic_filter("sport/tennis/player1"));
+    CHECK(valid_topic_filter("#"));
+    CHECK(valid_topic_filter("+"));
+    CHECK(valid_topic_filter("sport/#"));
+    CHECK(valid_topic_filter("sport/+/player1"));
+    CHECK(valid_topic_filter("+/+"));
+    CHECK(valid_topic_filter("/+"));
+    CHECK(valid_topic_filter("+/tennis/#"));
+    CHECK(!valid_topic_filter(""));
+    CHECK(!valid_topic_filter("sport+"));
+    CHECK(!valid_topic_filter("sport/ten+"));
+    CHECK(!valid_topic_filter("sport/tennis#"));
+    CHECK(!valid_topic_filter("sport/#/ranking"));
+    CHECK(!valid_topic_filter("##"));
+    CHECK(!valid_topic_filter(str("a/\0", 3)));
+    CHECK(!valid_topic_filter(std::string(40, 'x') + "#"));
+    CHECK(valid_topic_filter(std::string(40, 'x') + "/#"));
+}
+
+static void test_matching() {
+    CHECK(topic_matches("sport/tennis/player1", "sport/tennis/player1"));
+    CHECK(!topic_matches("sport/tennis/player1", "sport/tennis/player2"));
+    CHECK(topic_matches("sport/tennis/#", "sport/tennis/player1/ranking"));
+    CHECK(topic_matches("sport/#", "sport"));
+    CHECK(topic_matches("#", "sport/tennis"));
+    CHECK(topic_matches("sport/+/player1", "sport/tennis/player1"));
+    CHECK(!topic_matches("sport/+/player1", "sport/tennis/player2"));
+    CHECK(topic_matches("sport/+", "sport/"));
+    CHECK(!topic_matches("sport/+", "sport"));
+    CHECK(!topic_matches("sport/+", "sport/tennis/player1"));
+    CHECK(topic_matches("+/+", "/finance"));
+    CHECK(topic_matches("/+", "/finance"));
+    CHECK(!topic_matches("+", "/finance"));
+    CHECK(!topic_matches("sport", "sport/tennis"));
+    CHECK(!topic_matches("sport/tennis", "sport"));
+    // wildcards at the start don't match $ topics (4.7.2)
+    CHECK(!topic_matches("#", "$SYS/broker"));
+    CHECK(!topic_matches("+/broker", "$SYS/broker"));
+    CHECK(topic_matches("$SYS/#", "$SYS/broker"));
+}
+
+int main() {
+    // run everything with each implementation the cpu has
+    for(SimdLevel level : { SimdLevel::scalar, SimdLevel::sse4, SimdLevel::avx2 }) {
+        set_simd_level(level);
+        if(simd_level() != level) {
+            continue;
+        }
+        test_strings();
+        test_topic_names();
+        test_topic_filters();
+    }
+    test_matching();
+    if(failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "validation tests passed" << std::endl;
+    return 0;
+}
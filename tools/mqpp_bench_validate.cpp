@@ -0,0 +1,89 @@
+/**
+ * Benchmark for the mqtt string and topic validation
+ *
+ * Reports the throughput of valid_topic_name() and valid_string() for
+ * typical topic lengths with each implementation the cpu supports.
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. 
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Validation.h"
+
+using namespace mqpp::protocol;
+
+static const char *level_name(SimdLevel level) {
+    switch(level) {
+        case SimdLevel::avx2: return "avx2";
+        case SimdLevel::sse4: return "sse4";
+        default: return "scalar";
+    }
+}
+
+/** a set of distinct topics of the given length, like "site/3/device/17/temp..." */
+static std::vector<std::string> make_topics(size_t length) {
+    std::vector<std::string> topics;
+    for(int i = 0; i < 64; ++i) {
+        std::string t = "site/" + std::to_string(i) + "/device/" + std::to_string(i * 7) + "/";
+        while(t.size() < length) t += "telemetry/"[t.size() % 10];
+        t.resize(length);
+        topics.push_back(t);
+    }
+    return topics;
+}
+
+template<typename F>
+static double gbps(const std::vector<std::string> &topics, F check) {
+    size_t bytes = 0;
+    size_t ok = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed;
+    do {
+        for(int rep = 0; rep < 1000; ++rep) {
+            for(const auto &t : topics) {
+                ok += check(t);
+                bytes += t.size();
+            }
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while(elapsed.count() < 0.2);
+    if(ok == 0) std::cerr << "unexpected: nothing valid" << std::endl;
+    return bytes / elapsed.count() / 1e9;
+}
+
+int main() {
+    const SimdLevel best = simd_level();
+    const size_t lengths[] = { 16, 32, 64, 128, 256, 1024 };
+
+    std::cout << std::setw(8) << "impl" << std::setw(8) << "length"
+              << std::setw(14) << "topic GB/s" << std::setw(14) << "string GB/s" << std::endl;
+    for(int l = 0; l <= static_cast<int>(best); ++l) {
+        set_simd_level(static_cast<SimdLevel>(l));
+        for(size_t length : lengths) {
+            auto topics = make_topics(length);
+            double topic = gbps(topics, [](const std::string &t) { return valid_topic_name(t); });
+            double str = gbps(topics, [](const std::string &t) { return valid_string(t); });
+            std::cout << std::setw(8) << level_name(simd_level()) << std::setw(8) << length
+                      << std::fixed << std::setprecision(2)
+                      << std::setw(14) << topic << std::setw(14) << str << std::endl;
+        }
+    }
+    return 0;
+}
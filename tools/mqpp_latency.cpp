@@ -0,0 +1,157 @@
+/**
+ * Round trip latency tool for mqpp
+ *
+ * Subscribes to a topic, publishes to it and waits for the broker to
+ * deliver the message back, once with the default socket options and
+ * once with SocketOpts::low_latency(). Reports p50 / p99 / max of the
+ * round trip for both, so the effect of the profile can be compared on
+ * a given host and broker.
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. 
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mqpp.h"
+
+using namespace mqpp;
+typedef std::chrono::steady_clock clock_type;
+
+static void usage() {
+    std::cerr << "usage: mqpp_latency [--host HOST] [--port PORT] [--count N] [--size BYTES] [--cpu CPU] [--topic TOPIC]" << std::endl;
+    exit(1);
+}
+
+/** run the client loop until done() or the timeout, @return done() */
+template<typename F>
+static bool loop_until(mqtt_client &client, F done, std::chrono::milliseconds timeout) {
+    auto deadline = clock_type::now() + timeout;
+    while(!done()) {
+        if(clock_type::now() > deadline) return false;
+        client.loop(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+/**
+ * measure count round trips with the given options
+ * @return round trip times in microseconds, empty on failure */
+static std::vector<double> measure(const std::string &host, int port, const SocketOpts &opts,
+                                   int count, size_t size, const std::string &topic)
+{
+    std::vector<double> rtt;
+    mqtt_client client;
+    bool open = false, subscribed = false;
+
+    client.set_logging_callback([](LogLevel lvl, std::string text) {
+        if(lvl >= LogLevel::warn) std::cerr << "mqpp: " << text << std::endl;
+    }, LogLevel::warn);
+    client.set_connect_status_callback([&](ConnectionState state, DisconnectReason reason) {
+        open = state == ConnectionState::open;
+    });
+    client.set_subscribe_callback([&](const std::vector<std::string> &filters, const std::vector<SubscribeResult> &results) {
+        subscribed = !results.empty() && results[0] != SubscribeResult::failure;
+    });
+    // the echoed message is picked up through the last value cache
+    client.set_last_value_cache_opts(16);
+    client.add_last_value_filter(topic);
+
+    client.connect(host, port, std::chrono::seconds(20), "", opts);
+    if(!loop_until(client, [&]() { return open; }, std::chrono::seconds(5))) {
+        std::cerr << "can't connect to " << host << ":" << port << std::endl;
+        return rtt;
+    }
+    client.subscribe({ { topic, QoS::at_most_once } });
+    if(!loop_until(client, [&]() { return subscribed; }, std::chrono::seconds(5))) {
+        std::cerr << "subscription to " << topic << " failed" << std::endl;
+        return rtt;
+    }
+
+    std::string payload(size, 'x');
+    int warmup = std::min(100, count);
+    for(int i = 0; i < warmup + count; ++i) {
+        uint64_t version = client.last_value_version(topic);
+        auto start = clock_type::now();
+        client.publish(topic, payload, QoS::at_most_once, Retain::no, Lane::high);
+        if(!loop_until(client, [&]() { return client.last_value_version(topic) != version; }, std::chrono::seconds(1))) {
+            std::cerr << "message " << i << " didn't come back" << std::endl;
+            rtt.clear();
+            return rtt;
+        }
+        if(i >= warmup) {
+            rtt.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - start).count());
+        }
+    }
+    return rtt;
+}
+
+static void report(const char *name, std::vector<double> rtt) {
+    if(rtt.empty()) {
+        std::cout << std::left << std::setw(12) << name << "failed" << std::endl;
+        return;
+    }
+    std::sort(rtt.begin(), rtt.end());
+    auto pct = [&](double p) { return rtt[std::min(rtt.size() - 1, static_cast<size_t>(p * rtt.size()))]; };
+    std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << pct(0.5)
+              << std::setw(10) << pct(0.99)
+              << std::setw(10) << rtt.back() << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::string host = "localhost";
+    std::string topic = "mqpp/latency";
+    int port = 1883;
+    int count = 10000;
+    size_t size = 64;
+    int cpu = -1;
+
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "--host") && i + 1 < argc) {
+            host = argv[++i];
+        } else if(!strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--count") && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--size") && i + 1 < argc) {
+            size = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--cpu") && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--topic") && i + 1 < argc) {
+            topic = argv[++i];
+        } else {
+            usage();
+        }
+    }
+    if(count < 1) usage();
+
+    // the default profile runs first, low_latency() may pin this thread
+    std::vector<double> standard = measure(host, port, SocketOpts(), count, size, topic);
+    std::vector<double> low = measure(host, port, SocketOpts::low_latency(cpu), count, size, topic);
+
+    std::cout << count << " round trips of " << size << " byte publishes, microseconds" << std::endl;
+    std::cout << std::left << std::setw(12) << "profile" << std::right
+              << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+    report("default", standard);
+    report("low_latency", low);
+    return standard.empty() || low.empty() ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * Replay tool for mqpp wire captures
+ *
+ * Feeds the inbound frames of a capture (see mqtt_client::start_capture)
+ * through the client's parser and dispatch path, without a broker, and
+ * reports the throughput. Useful to profile the receive path with real
+ * traffic.
+ *
+ * Copyright 2017 Christian Bendele
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. 
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "mqpp.h"
+
+static void usage() {
+    std::cerr << "usage: mqpp_replay [--realtime] [--repeat N] [--cache FILTER] capture-file" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    bool realtime = false;
+    int repeat = 1;
+    std::string path;
+    mqpp::mqtt_client client;
+
+    client.set_logging_callback([](mqpp::LogLevel lvl, std::string text) {
+        std::cerr << "mqpp: " << text << std::endl;
+    }, mqpp::LogLevel::warn);
+
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "--realtime")) {
+            realtime = true;
+        } else if(!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--cache") && i + 1 < argc) {
+            // exercise the last value cache as part of dispatch
+            client.add_last_value_filter(argv[++i]);
+        } else if(argv[i][0] == '-' || !path.empty()) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+    if(path.empty() || repeat < 1) usage();
+
+    long frames = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < repeat; ++i) {
+        int n = client.replay(path, realtime);
+        if(n < 0) return 1;
+        frames += n;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << frames << " frames in " << elapsed.count() << " s, "
+              << frames / elapsed.count() << " frames/s" << std::endl;
+    return 0;
+}